@@ -0,0 +1,75 @@
+// Copyright (c) 2026 Akritas Akritidis, see LICENSE for license details
+
+// Microbenchmark of the literal search against memmem, on the content of real files
+//   make bench && ./bench FILE LITERAL...
+
+#define main mfg_main
+#include "mfg.c"
+#undef main
+
+#define BENCH_ROUNDS 20
+
+int main(int argc, char *argv[]) {
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: bench FILE LITERAL...\n");
+		return ERROR_INPUT;
+	}
+	init_byte_frequency();
+
+	FILE *file = fopen(argv[1], "r");
+	if (!file) {
+		perror(argv[1]);
+		return ERROR_INPUT;
+	}
+	fseek(file, 0, SEEK_END);
+	size_t len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *text = malloc(len + 1);
+	if (!text || fread(text, 1, len, file) != len) {
+		fprintf(stderr, "bench: could not read '%s'\n", argv[1]);
+		return ERROR_INTERNAL;
+	}
+	fclose(file);
+	char *text_end = text + len;
+
+	printf("%-24s %10s %12s %12s %8s\n", "literal", "matches", "memmem MB/s", "rare MB/s", "speedup");
+	for (int i = 2; i < argc; i++) {
+		pattern_any P = {.arg = argv[i]};
+		P.len = strlen(P.arg);
+		if (!P.len || P.len >= PATTERN_MAX_LEN) continue;
+		strcpy(P.text, P.arg);
+		init_literal(&P, P.len);
+
+		size_t matches[2] = {0};
+		nanos times[2] = {0};
+		for_each(round, BENCH_ROUNDS) {
+			for_each(method, 2) {
+				size_t count = 0;
+				nanos start = now_ns();
+				for (char *cursor = text; cursor < text_end; cursor += 1) {
+					cursor = method ? literal_find(&P, P.len, cursor, text_end)
+									: memmem(cursor, text_end - cursor, P.text, P.len);
+					if (!cursor) break;
+					count += 1;
+				}
+				times[method] += now_ns() - start;
+				matches[method] = count;
+			}
+		}
+		if (matches[0] != matches[1]) {
+			fprintf(stderr, "bench: '%s' found %zu times by memmem but %zu times\n", P.arg, matches[0], matches[1]);
+			return ERROR_INTERNAL;
+		}
+
+		double mb = (double)len * BENCH_ROUNDS / (1024 * 1024);
+		double rates[2];
+		for_each(method, 2) {
+			rates[method] = mb / (times[method] / 1e9);
+		}
+		printf("%-24.24s %10zu %12.0f %12.0f %7.2fx\n", P.arg, matches[0], rates[0], rates[1], rates[1] / rates[0]);
+	}
+
+	free(text);
+	return 0;
+}
@@ -0,0 +1,49 @@
+// Copyright (c) 2026 Akritas Akritidis, see LICENSE for license details
+
+// libmfg, the search of mfg in a long lived process
+//
+// A context keeps the io_uring ring, the read buffers and the parsed query
+// between searches. The query is given with the arguments of mfg, without
+// the roots, and the results are passed to a callback instead of printed.
+// One search runs at a time in a process, the paths are resolved from the
+// root without changing the working directory.
+
+#ifndef LIBMFG_H
+#define LIBMFG_H
+
+#include <stddef.h>
+
+#define MFG_API __attribute__((visibility("default")))
+
+typedef struct mfg_context mfg_context;
+
+typedef struct {
+	char kind;
+#define MFG_RESULT_PATH 'p'
+#define MFG_RESULT_LINE 'l'
+#define MFG_RESULT_CONTEXT 'c'
+#define MFG_RESULT_COUNT 'n' // with -c, the line is the number of matches of the file
+	const char *path;
+	long line;
+	const char *text; // the line, not null terminated
+	size_t text_len;
+	size_t match_start; // offsets of the match in the line
+	size_t match_end;
+	int pattern; // index of the matched content pattern
+} mfg_result;
+
+typedef void (*mfg_callback)(const mfg_result *result, void *data);
+
+MFG_API mfg_context *mfg_context_create(void);
+MFG_API void mfg_context_free(mfg_context *context);
+
+// parses the query, arguments as for mfg starting with the file type, returns non zero on errors
+MFG_API int mfg_compile(mfg_context *context, int argc, char *argv[]);
+
+// searches under the root, returns the number of matches or -1 on errors
+MFG_API long mfg_search(mfg_context *context, const char *root, mfg_callback callback, void *data);
+
+// the usage of the arguments
+MFG_API const char *mfg_help(void);
+
+#endif
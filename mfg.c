@@ -2,7 +2,9 @@
 
 #define _GNU_SOURCE
 
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,22 +13,85 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <regex.h>
+#include <sys/mman.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/futex.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <fts.h>
 #include <liburing.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "libmfg.h"
+
+#ifdef MFG_ZLIB
+#include <zlib.h>
+#endif
+#ifdef MFG_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#endif
+#ifdef MFG_ZSTD
+#include <zstd.h>
+#endif
 
 #define FILE_ENTRIES 32
 #define FIXED_BUFFER_SIZE 64 * 1024
-#define INIT_BFS_QUEUE_CAPACITY 64 * 1024
+#define BFS_QUEUE_CHUNK_SIZE 64 * 1024
+#define BFS_QUEUE_MEMORY_CAP 64 * 1024 * 1024
 #define GETENTS_BUFFER_CAPACITY 64 * 1024
+#define DFS_BUFFER_CAPACITY 32 * 1024
+#define DFS_FD_BUDGET 64
+#define METADATA_BATCH 64
 #define BINARY_FAST_CHECK_LEN 1 * 1024
 #define BINARY_CHECK_LEN 4 * 1024
+#define PROBE_BUFFER_SIZE 4 * 1024 + 64
+#define DIRECT_READ_THRESHOLD 1024 * 1024
+#define DIRECT_READ_ALIGN 4096
+#define SPARSE_READ_THRESHOLD 1024 * 1024
 #define MAX_CONTENT_PATTERNS 12
 #define PATTERN_MAX_LEN 1024
 #define DEFAULT_PRINT_LIMIT 300
+#define STATS_LATENCY_BUCKETS 24
+#define DECOMPRESS_CHUNK_SIZE 1024 * 1024
+#define DECOMPRESS_CHUNKS 2
+#define PARALLEL_SEARCH_THRESHOLD 16 * 1024 * 1024
+#define PARALLEL_SEARCH_MIN_REGION 1024 * 1024
+#define PARALLEL_SEARCH_SPLIT 4
+#define REGEX_WINDOW 1024 * 1024 * 1024
+#define SCHEDULE_WINDOW 256
+#define PIPELINE_SLOTS 1024
+#define PIPELINE_PATH_LEN 256
+#define INPUT_CHUNK_SIZE 256 * 1024
+#define INPUT_PIPE_SIZE 1024 * 1024
+#define SERVE_BACKLOG 64
+#define SERVE_QUERY_CAPACITY 64 * 1024
+#define SERVE_QUERY_ARGS 256
+#define SERVE_CLIENTS 64
+#define SERVE_CLIENT_TIMEOUT 5000
+#define WATCH_EVENTS IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE
+#define RESULT_CACHE_MAGIC "mfgres2"
+#define RESULT_CACHE_ENTRY_LIMIT 1024 * 1024
+#define RESULT_CACHE_MAX_AGE 30 * 24 * 3600
+#define CLASS_TABLE_SIZE 4096
+#define CLASS_EXTENSION_LEN 16
+#define CLASS_LEARN_MIN 16
+#define CLASS_LEARN_SAMPLE 64
 
 // === types
 
@@ -34,6 +99,7 @@ typedef char check;
 typedef char *string;
 typedef __mode_t filemode;
 typedef __off_t filesize;
+typedef unsigned long long nanos;
 
 //
 
@@ -49,14 +115,264 @@ typedef struct {
 	char path[PATH_MAX];
 	filemode mode;
 	filesize size;
+	dev_t dev;
+	ino_t ino;
+	nanos mtime;
 
 	file_buffer fixed_buffer;
 	file_buffer buffer;
 	struct iovec iov;
-
+	nanos submitted;
+	struct scheduled_file *scheduled;
+
+	char nowait;
+	char cached;
+	char unknown; // the residency could not be checked, the page cache is left as it is
+	char direct;
+	char compression;
+	char matched;
 	char ready;
 } file_entry;
 
+typedef struct {
+	size_t count;
+	size_t bytes;
+	nanos time;
+} stage_stats;
+
+typedef struct {
+	char *start;
+	char *end;
+	int index;
+} search_match;
+
+typedef struct {
+	filesize line;
+	int pending_around_lines;
+	int unprinted_lines;
+	size_t matches;
+	search_match *found;
+	size_t found_len;
+	char presearched;
+	char stream;
+	char done;
+} search_state;
+
+typedef struct {
+	char *start;
+	char *end;
+	filesize lines;
+	search_match *found;
+	size_t found_len;
+	size_t found_capacity;
+} search_region;
+
+typedef struct {
+	char *text_end;
+	search_region *regions;
+	size_t regions_len;
+	size_t next;
+} parallel_search;
+
+typedef struct {
+	char *start;
+	size_t size;
+	size_t capacity;
+	size_t cursor;
+	search_state state;
+} search_stream;
+
+struct linux_dirent64 {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+typedef struct {
+	long long over; // exclusive
+	long long upto; // inclusive
+} range;
+#define RANGE_ANY {LLONG_MIN, LLONG_MAX}
+
+typedef struct {
+	struct stat *stats; // a zero mode for a failed stat
+	int *positions;		// of the entries in the getdents buffer
+	size_t len;
+	size_t capacity;
+	size_t next;
+} stat_batch;
+
+typedef struct {
+	int fd;
+	off_t offset;
+	size_t path_len;
+	char *buffer;
+	int nread;
+	int bpos;
+	stat_batch batch;
+} dfs_frame;
+
+typedef struct inode_alias {
+	struct inode_alias *next;
+	char path[];
+} inode_alias;
+
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	char state;
+#define I_empty 0
+#define I_directory 'd'
+#define I_pending 'p'
+#define I_matched 'm'
+#define I_unmatched 'u'
+#define I_changed 'c'
+	inode_alias *aliases;
+} inode_entry;
+
+typedef struct {
+	char magic[8];
+	unsigned long long query;
+	size_t count;
+} result_cache_header;
+
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	filesize size;
+	nanos mtime;
+	size_t offset;
+	size_t length;
+	time_t used; // last run that searched or replayed the file
+} result_cache_entry;
+
+typedef struct {
+	char extension[CLASS_EXTENSION_LEN]; // lowercase, empty for a free slot
+	char known;							 // binary in the built-in or user table
+	unsigned int binary;				 // learned outcomes of the binary check
+	unsigned int text;
+	unsigned int skipped; // in this run, every CLASS_LEARN_SAMPLE one is read to check it again
+} class_entry;
+
+typedef struct {
+	char kind;
+#define R_line 'l'
+#define R_count 'c'
+#define R_path 'p'
+#define R_total 't'
+	int pattern;
+	filesize line;
+	unsigned int line_len;
+	unsigned int result_start;
+	unsigned int result_len;
+} result_record;
+
+typedef struct scheduled_file {
+	string path;
+	struct stat st;
+	int fd;
+	char direct;
+	char mapped;
+	char held; // output found without reading, waiting behind the files before it
+	unsigned long long position;
+	FILE *stream;
+	char *output;
+	size_t output_len;
+} scheduled_file;
+
+typedef struct {
+	int root;
+	string path;
+} watch_dir;
+
+typedef struct {
+	string path;
+	string name;
+	filemode mode;
+	filesize size;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	char hidden;
+	char removed;
+	char pruned;
+} snapshot_entry;
+
+typedef struct {
+	int fd; // -1 for a free slot
+	char query[SERVE_QUERY_CAPACITY];
+	size_t len;
+	nanos accepted;
+	size_t queued; // order of the complete queries, 0 while reading
+	char failed;
+} serve_client;
+
+typedef struct {
+	int root;
+	string path;
+	ino_t ino;
+	filesize size;
+	filesize offset;
+	filesize lines;
+	char present;
+} watch_file;
+
+typedef struct bfs_chunk {
+	struct bfs_chunk *next;
+	char *data;
+	size_t size;
+	off_t spilled;
+} bfs_chunk;
+
+typedef struct {
+	struct stat st;
+	char *path; // the inline one, or allocated for longer paths, null at the end of the traversal
+	char inline_path[PIPELINE_PATH_LEN];
+} pipeline_slot;
+
+typedef struct {
+	pipeline_slot *slots;
+	// each written by one side only, apart to not share a cache line
+	unsigned int head __attribute__((aligned(64))); // next to pop, by the searching thread
+	unsigned int tail __attribute__((aligned(64))); // next to push, by the traversal thread
+	unsigned int head_waiting;
+	unsigned int tail_waiting;
+	pthread_t thread;
+	int result; // of the traversal
+	int errors;
+} pipeline_queue;
+
+typedef struct {
+	char format;
+#define C_gzip 'g'
+#define C_zstd 'z'
+#define S_resident 'r'
+#define S_cold 'c'
+#define S_unknown 'u'
+	char *input;
+	size_t input_len;
+#ifdef MFG_ZLIB
+	z_stream gzip;
+#endif
+#ifdef MFG_ZSTD
+	ZSTD_DStream *zstd;
+	ZSTD_inBuffer zstd_input;
+#endif
+	char *chunks[DECOMPRESS_CHUNKS];
+	size_t chunk_sizes[DECOMPRESS_CHUNKS];
+	size_t produced;
+	size_t consumed;
+	char threaded;
+	char finished;
+	char failed;
+	char stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} decompressor;
+
 //
 
 typedef char pattern_star;
@@ -65,6 +381,8 @@ typedef struct {
 	char *arg;
 	char text[PATTERN_MAX_LEN];
 	int len;
+	int rare1;
+	int rare2;
 } pattern_any;
 typedef pattern_any pattern_start;
 typedef pattern_any pattern_end;
@@ -72,6 +390,10 @@ typedef pattern_any pattern_end;
 typedef struct {
 	pattern_any start;
 	pattern_any end;
+	// the first end found searching from end_from up to end_limit, kept for the later starts
+	char *end_from;
+	char *end_at;
+	char *end_limit;
 } pattern_wrap;
 
 typedef struct {
@@ -96,30 +418,177 @@ typedef struct {
 		pattern_regex regex;
 	} as;
 	int index;
+	char negated;
 	char *match_start;
 	char *match_end;
 } pattern;
 
+// the state of a query, the engine works on the active one
+struct mfg_context {
+	check option_help;
+	check option_bfs;
+	check option_query;
+	check option_plain;
+	check option_monochrome;
+	check option_table;
+	check option_unhidden;
+	check option_verbose;
+	check option_stats;
+	check option_no_cache;
+	check option_decompress;
+	check option_parallel;
+	check option_unique;
+	check option_result_cache;
+	check option_watch;
+	check option_disk_order;
+	check option_serve;
+	check option_client;
+	check option_input;
+	check option_count;
+	check option_learn;
+	check option_pipeline;
+	size_t option_limit;
+	char option_file_type;
+	char option_name_mode;
+	string option_name_pattern;
+	check option_name_case;
+	check option_name_omit;
+	range option_size;
+	range option_age;
+	range option_directory_age;
+	check option_content_case;
+	check option_content_omit;
+	check option_content_only;
+	check option_content_multiline;
+	check option_content_around;
+	check option_content_all;
+	check option_content_exclude;
+	size_t option_content_limit;
+
+	pattern content_patterns[MAX_CONTENT_PATTERNS];
+	int content_patterns_len;
+	pattern *content_terms[MAX_CONTENT_PATTERNS];
+	int content_terms_len;
+
+	check skip_loading;
+	check probe_loading;
+	check dump_files;
+	check metadata_files;
+	check metadata_directories;
+
+	// the reads, kept between searches, until a query needs the other kind of buffers
+	struct io_uring ring;
+	file_entry *files;
+	int files_capacity;
+	int files_count;
+	char *fixed_buffers;
+	char loading;
+	char loading_probe;
+
+	// the arguments the patterns point into
+	int argc;
+	char **argv;
+	char compiled; // parsed without errors
+};
+
 // === state
 
 char **roots = 0;
 int roots_count = 0;
 int roots_index = 0;
-
-char *bfs_queue_buffer;
-size_t bfs_queue_capacity;
-char *bfs_queue_start;
-char *bfs_queue_end;
-
-file_entry files[FILE_ENTRIES];
-int files_count = 0;
-char *fixed_buffers;
-struct io_uring ring;
-
-pattern content_patterns[MAX_CONTENT_PATTERNS];
-int content_patterns_len = 0;
-
-int errors_count = 0;
+int root_fd = AT_FDCWD;
+
+bfs_chunk *bfs_queue_head = 0;
+bfs_chunk *bfs_queue_tail = 0;
+size_t bfs_queue_read = 0;
+size_t bfs_queue_chunks_in_memory = 0;
+int bfs_spill_fd = -1;
+off_t bfs_spill_size = 0;
+size_t bfs_spilled_chunks = 0;
+char bfs_parent[PATH_MAX];
+
+pipeline_queue pipeline;
+__thread check pipeline_traversing = 0;
+
+struct io_uring metadata_ring;
+char metadata_ring_state = 0;
+file_entry input_file_entry;
+
+unsigned char byte_frequency[256];
+
+inode_entry *inodes = 0;
+size_t inodes_capacity = 0;
+size_t inodes_count = 0;
+
+char result_cache_path[PATH_MAX];
+unsigned long long result_cache_query = 0;
+char *result_cache_map = 0;
+size_t result_cache_map_size = 0;
+result_cache_entry *result_cache_old = 0;
+size_t result_cache_old_count = 0;
+char *result_cache_old_data = 0;
+size_t result_cache_old_data_size = 0;
+char *result_cache_old_state = 0; // for each old entry, replayed or stale in this run
+#define C_replayed 'r'
+#define C_stale 's'
+result_cache_entry *result_cache_new = 0;
+size_t result_cache_new_count = 0;
+size_t result_cache_new_capacity = 0;
+char *result_cache_data = 0;
+size_t result_cache_data_size = 0;
+size_t result_cache_data_capacity = 0;
+file_entry result_cache_file;
+
+class_entry classes[CLASS_TABLE_SIZE];
+size_t classes_count = 0;
+char classes_path[PATH_MAX];
+check classes_ready = 0;
+check classes_builtin = 0;
+check classes_learned = 0;
+
+struct {
+	char active;
+	int errors;
+	size_t start;
+} result_capture;
+
+scheduled_file schedule[SCHEDULE_WINDOW];
+scheduled_file *schedule_sorted[SCHEDULE_WINDOW];
+int schedule_len = 0;
+FILE *output;
+
+int watch_fd = -1;
+int *watch_roots = 0;
+watch_dir *watch_dirs = 0;
+int watch_dirs_capacity = 0;
+watch_file *watch_files = 0;
+size_t watch_files_capacity = 0;
+size_t watch_files_count = 0;
+file_entry watch_file_entry;
+
+snapshot_entry *snapshot = 0;
+size_t snapshot_len = 0;
+size_t snapshot_removed = 0;
+size_t snapshot_capacity = 0;
+size_t *snapshot_index = 0;
+size_t snapshot_index_capacity = 0;
+char serve_socket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+mfg_callback result_callback = 0;
+void *result_callback_data = 0;
+
+__thread int errors_count = 0; // the traversal thread of -P adds its own when done
+size_t matches_count = 0;
+
+struct {
+	stage_stats list, stat, open, read, overflow, sparse, binary, search, output;
+	size_t binary_skips;
+	size_t class_skips;
+	size_t metadata_skips;
+	size_t hole_bytes;
+	size_t result_cache_hits;
+	size_t read_latency[STATS_LATENCY_BUCKETS];
+} stats;
 
 // === utils
 
@@ -131,8 +600,15 @@ int errors_count = 0;
 #define str_equals(s1, s2) (strcmp(s1, s2) == 0)
 #define str_is_option(s) ((s)[0] == '-' && (s)[1])
 
+#define limit_reached() (context->option_limit && __atomic_load_n(&matches_count, __ATOMIC_RELAXED) >= context->option_limit)
+
 #define implies(a, b) (!(a) || (b))
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+#define range_contains(r, value) ((value) > (r).over && (value) <= (r).upto)
+
+#define stat_mtime_ns(st) ((st)->st_mtim.tv_sec * 1000000000ull + (st)->st_mtim.tv_nsec)
 
 #define path_dot(x) ((x)[0] == '.' && !(x)[1])
 #define path_ddot(x) ((x)[0] == '.' && (x)[1] == '.' && !(x)[2])
@@ -140,16 +616,44 @@ int errors_count = 0;
 
 #define for_each(I, LEN) for (size_t I = 0; I < (LEN); I++)
 
-#define printf_output(fmt, ...) fprintf(stdout, fmt "\n", ##__VA_ARGS__);
+#define printf_output(fmt, ...) fprintf(output, fmt "\n", ##__VA_ARGS__);
 #define printf_error(fmt, ...) fprintf(stderr, "mfg: " fmt "\n", ##__VA_ARGS__);
 #define printf_error_verbose(fmt, ...) \
-	if (option_verbose) fprintf(stderr, "mfg: " fmt "\n", ##__VA_ARGS__);
+	if (context->option_verbose) fprintf(stderr, "mfg: " fmt "\n", ##__VA_ARGS__);
 
 #define ERROR_INPUT 1
 #define ERROR_INTERNAL 2
 
+#define STATS_BEGIN(T) nanos T = context->option_stats ? now_ns() : 0;
+#define STATS_END(STAGE, T, COUNT, BYTES) \
+	if (context->option_stats) stats_record(&stats.STAGE, T, COUNT, BYTES);
+
+#ifdef MFG_SDT
+// a probe is a nop until a tracer attaches and sets its semaphore, the arguments are only evaluated then
+#define PROBE_SEMAPHORE(NAME) unsigned short mfg_##NAME##_semaphore __attribute__((unused, section(".probes")));
+#define PROBE_ENABLED(NAME) __builtin_expect(mfg_##NAME##_semaphore, 0)
+#define PROBE(NAME, ...) \
+	if (PROBE_ENABLED(NAME)) STAP_PROBEV(mfg, NAME, ##__VA_ARGS__);
+#define PROBE_KEEP(TYPE, T, VALUE) TYPE T = VALUE;
+#else
+#define PROBE_SEMAPHORE(NAME)
+#define PROBE_ENABLED(NAME) 0
+#define PROBE(NAME, ...)
+#define PROBE_KEEP(TYPE, T, VALUE)
+#endif
+#define PROBE_BEGIN(T, NAME) PROBE_KEEP(nanos, T, PROBE_ENABLED(NAME) ? now_ns() : 0)
+
+PROBE_SEMAPHORE(list)
+PROBE_SEMAPHORE(submit)
+PROBE_SEMAPHORE(read)
+PROBE_SEMAPHORE(overflow)
+PROBE_SEMAPHORE(binary)
+PROBE_SEMAPHORE(search_start)
+PROBE_SEMAPHORE(search_end)
+PROBE_SEMAPHORE(match)
+
 #define COL(X) ("\e[" X "m")
-#define COLOR(X) (option_plain ? "" : (COL(X)))
+#define COLOR(X) (context->option_plain ? "" : (COL(X)))
 
 #define COLOR_PATH COLOR("2;95")
 #define COLOR_SEP COLOR("0;34")
@@ -161,63 +665,85 @@ const char *match_colors[] = {
 	COL("1;91"), COL("1;93"), COL("1;94"), COL("1;92"), COL("1;95"), COL("1;96"), //
 };
 #define COLOR_MATCH_ARRAY(I) (match_colors[(I) % (sizeof(match_colors) / sizeof(void *))])
-#define COLOR_MATCH(I) (option_plain ? "" : option_monochrome ? COLOR_MATCH_ARRAY(0) \
+#define COLOR_MATCH(I) (context->option_plain ? "" : context->option_monochrome ? COLOR_MATCH_ARRAY(0) \
 															  : COLOR_MATCH_ARRAY(I))
 
 // === options
 
-check option_help = 0;
-check option_bfs = 0;
-check option_query = 0;
-check option_plain = 0;
-check option_monochrome = 0;
-check option_table = 0;
-check option_unhidden = 0;
-check option_verbose = 0;
-char option_file_type = 'a';
 string possible_option_file_type = "afdetb";
 string mappings_option_file_type = "afdetb";
-char option_name_mode = '-';
 string possible_option_name_mode = "bspef";
 string mappings_option_name_mode = "sssef";
-string option_name_pattern = 0;
-check option_name_case = 0;
-check option_name_omit = 0;
-check option_content_case = 0; // TODO
-check option_content_omit = 0;
-check option_content_only = 0;
-check option_content_multiline = 0; // TODO
-check option_content_around = 0;
+string units_option_size = "ckMG";
+const long long scales_option_size[] = {1, 1024, 1024 * 1024, 1024 * 1024 * 1024};
+string units_option_age = "smhdw";
+const long long scales_option_age[] = {1000000000ll, 60 * 1000000000ll, 3600 * 1000000000ll, 86400 * 1000000000ll, 604800 * 1000000000ll};
 string possible_option_content_mode = "bspewr";
 string mappings_option_content_mode = "sssewr";
 
-check skip_loading = 0;
-check dump_files = 0;
+mfg_context main_context = {
+	.option_file_type = 'a',
+	.option_name_mode = '-',
+	.option_size = RANGE_ANY,
+	.option_age = RANGE_ANY,
+	.option_directory_age = RANGE_ANY,
+};
+mfg_context *context = &main_context;
+
+long long metadata_now = 0;
 
 // === main
 
+#ifndef MFG_LIBRARY
 int main(int argc, char *argv[]) {
 
+	output = stdout;
+	init_byte_frequency();
+
 	int args_error = handle_args(argc, argv);
 	if (args_error) return ERROR_INPUT;
 
-	if (option_help) {
+	if (context->option_help) {
 		printf("%s", help);
 		return 0;
 	}
 
-	skip_loading = content_patterns_len == 0 && !str_contains("etb", option_file_type);
-	if (!skip_loading) {
+	init_query();
+	if (context->option_client) {
+		return client_run(argc, argv) ? ERROR_INTERNAL : 0;
+	}
+	if (context->option_serve) {
+		return serve_run() ? ERROR_INTERNAL : 0;
+	}
+	if (!context->skip_loading && !context->option_input) {
 		if (init_loading()) return ERROR_INTERNAL;
 	}
+	if (context->option_result_cache && result_cache_open()) {
+		context->option_result_cache = 0;
+	}
+	if (context->option_learn && classes_open()) {
+		context->option_learn = 0;
+	}
+	if (context->option_watch && !isatty(STDIN_FILENO)) {
+		printf_error("Watching needs roots to traverse, not paths from the input");
+		return ERROR_INPUT;
+	}
+	if (context->option_watch && watch_init()) return ERROR_INTERNAL;
 
-	if (isatty(STDIN_FILENO)) {
+	if (context->option_input) {
+		if (input_search()) return ERROR_INTERNAL;
+	} else if (isatty(STDIN_FILENO)) {
 		if (!roots_count) {
+			if (context->option_watch) watch_add_root();
 			if (paths_handle()) return ERROR_INTERNAL;
 		} else {
 			for_each(i, roots_count) {
+				if (limit_reached()) break;
+				// the reordered files are opened from the root they were found in
+				if (context->option_disk_order) schedule_flush();
 				roots_index = i;
-				if (change_dir(roots[i])) continue;
+				if (root_open(roots[i])) continue;
+				if (context->option_watch) watch_add_root();
 				if (paths_handle()) return ERROR_INTERNAL;
 			}
 		}
@@ -225,18 +751,56 @@ int main(int argc, char *argv[]) {
 		if (paths_read()) return ERROR_INTERNAL;
 	}
 	handle_last_content_loaded();
+	if (context->option_result_cache) {
+		// saved once, the files searched again by -w are not captured
+		result_cache_save();
+		result_cache_release();
+		context->option_result_cache = 0;
+	}
+	if (context->option_learn) {
+		classes_save();
+	}
+	if (context->option_count > 1) {
+		printf_output("%s%zu%s", COLOR_COL, matches_count, COLOR_RESET);
+	}
+	if (context->option_watch) {
+		if (watch_run()) return ERROR_INTERNAL;
+	}
 
 	if (errors_count) {
 		printf_error("%d access errors occurred", errors_count);
 	}
+	if (context->option_stats) {
+		print_stats();
+	}
 
 	return 0;
 }
+#endif
+
+void init_query() {
+	init_terms();
+	init_metadata();
+	init_classes();
+
+	context->skip_loading = context->content_patterns_len == 0 && !str_contains("etb", context->option_file_type);
+	context->probe_loading = context->content_patterns_len == 0 && str_contains("tb", context->option_file_type) && !context->option_decompress;
+	// the traversal thread only overlaps with reads, the inodes and watches are not shared with it
+	if (context->skip_loading || context->option_unique || context->option_watch) context->option_pipeline = 0;
+}
 
 // === paths
 
 int paths_handle() {
-	if (!option_bfs) {
+	if (context->option_pipeline && !pipeline_traversing) {
+		return pipeline_run();
+	}
+	if (context->option_unique) {
+		// a bind mount looping back to the root is then found as visited, as is a root given twice
+		struct stat st;
+		if (!fstatat(root_fd, ".", &st, 0) && !inode_visit_directory(&st)) return 0;
+	}
+	if (!context->option_bfs) {
 		if (paths_traverse()) return 1;
 	} else {
 		if (paths_bfs()) return 1;
@@ -244,8 +808,13 @@ int paths_handle() {
 	return 0;
 }
 
-int change_dir(char *path) {
-	if (chdir(path)) {
+int root_open(char *path) {
+	root_close();
+
+	// the paths are resolved from the root, the working directory of the process is left as it is
+	root_fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (root_fd < 0) {
+		root_fd = AT_FDCWD;
 		errors_count += 1;
 		printf_error_verbose("Failed to find '%s'", path);
 		return 1;
@@ -253,95 +822,321 @@ int change_dir(char *path) {
 	return 0;
 }
 
+void root_close() {
+	if (root_fd != AT_FDCWD) close(root_fd);
+	root_fd = AT_FDCWD;
+}
+
+string root_resolve(char *buffer, string path) {
+	// for the calls without a directory fd
+	if (root_fd == AT_FDCWD) return path;
+	sprintf(buffer, "/proc/self/fd/%d/%s", root_fd, path);
+	return buffer;
+}
+
+DIR *root_opendir(string path) {
+	int fd = openat(root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) return 0;
+	DIR *dir = fdopendir(fd);
+	if (!dir) close(fd);
+	return dir;
+}
+
 int paths_traverse() {
 
-	char *paths[] = {".", 0};
-	FTS *tree = fts_open(paths, FTS_NOCHDIR | (skip_loading ? FTS_NOSTAT : 0), 0);
-	if (!tree) return 1;
+	char path[PATH_MAX + 2] = ".";
+	size_t stack_capacity = 64;
+	dfs_frame *stack = malloc(stack_capacity * sizeof(dfs_frame));
+	if (!stack) return 1;
 
-	while (1) {
-		FTSENT *node = fts_read(tree);
-		if (!node) break;
+	int depth = 0;
+	int open_fds = 0;
+	int lowest_open = 0;
+
+	if (paths_traverse_push(stack, &depth, &open_fds, root_fd, path, 1)) {
+		free(stack);
+		return 1;
+	}
+
+	while (depth && !limit_reached()) {
+		dfs_frame *frame = stack + depth - 1;
+		path[frame->path_len] = 0;
+
+		struct linux_dirent64 *d = paths_traverse_next(frame, path, &open_fds);
+		if (!d) {
+			if (frame->fd >= 0) {
+				close(frame->fd);
+				open_fds -= 1;
+			}
+			free(frame->buffer);
+			stat_batch_free(&frame->batch);
+			depth -= 1;
+			lowest_open = min(lowest_open, max(depth - 1, 0));
+			if (context->option_stats) stats.list.count += 1;
+			continue;
+		}
 
-		string path = node->fts_path;
-		string name = node->fts_name;
+		string name = d->d_name;
+		if (path_dot(name) || path_ddot(name)) continue;
+		if (context->option_unhidden && path_hidden(name)) continue;
 
-		char skip = (option_unhidden && path_hidden(name));
+		if (frame->path_len + strlen(name) + 2 > PATH_MAX) {
+			errors_count += 1;
+			printf_error_verbose("Path too long '%s/%s'", path, name);
+			continue;
+		}
+		path[frame->path_len] = '/';
+		strcpy(path + frame->path_len + 1, name);
+
+		unsigned char type = d->d_type;
+		struct stat st = {0};
+		if (metadata_needed(type)) {
+			if (paths_stat(frame->fd, name, (char *)d - frame->buffer, &frame->batch, &st)) {
+				errors_count += 1;
+				printf_error_verbose("Error reading '%s'", path);
+				continue;
+			}
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
 
-		switch (node->fts_info) {
-		case FTS_F:
-			if (!skip) {
-				filemode mode = skip_loading ? 0 : node->fts_statp->st_mode;
-				filesize size = skip_loading ? 0 : node->fts_statp->st_size;
-				handle_file(path + 2, name, mode, size);
+		if (type == DT_REG) {
+			handle_file(path + 2, name, &st);
+
+		} else if (type == DT_DIR) {
+			if (skip_directory(name)) continue;
+			if (!match_directory_metadata(&st)) continue;
+			if (context->option_unique && !paths_visit_directory(frame->fd, name, path)) continue;
+			handle_directory(path + 2, name);
+
+			if (open_fds >= DFS_FD_BUDGET) {
+				// close the fd of the shallowest open directory, it is reopened when returning to it
+				while (stack[lowest_open].fd < 0) lowest_open += 1;
+				dfs_frame *lowest = stack + lowest_open;
+				lowest->offset = lseek(lowest->fd, 0, SEEK_CUR);
+				close(lowest->fd);
+				lowest->fd = -1;
+				open_fds -= 1;
 			}
-			break;
-		case FTS_D:
-			if (skip || skip_directory(name)) {
-				fts_set(tree, node, FTS_SKIP);
-			} else {
-				handle_directory(path + 2, name);
+			if (depth == stack_capacity) {
+				stack_capacity *= 2;
+				dfs_frame *grown = realloc(stack, stack_capacity * sizeof(dfs_frame));
+				if (!grown) {
+					printf_error("Out of memory");
+					break;
+				}
+				stack = grown;
+				frame = stack + depth - 1;
 			}
-			break;
-		case FTS_ERR:
-		case FTS_DNR:
+			paths_traverse_push(stack, &depth, &open_fds, frame->fd, path, frame->path_len + 1 + strlen(name));
+		}
+	}
+
+	while (depth) {
+		dfs_frame *frame = stack + --depth;
+		if (frame->fd >= 0) close(frame->fd);
+		free(frame->buffer);
+		stat_batch_free(&frame->batch);
+	}
+	free(stack);
+	return 0;
+}
+
+int paths_traverse_push(dfs_frame *stack, int *depth, int *open_fds, int parent_fd, string path, size_t path_len) {
+
+	string name = basename_pointer(path);
+	int fd = openat(parent_fd, parent_fd == root_fd ? path : name, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		errors_count += 1;
+		printf_error_verbose("Error reading '%s'", path);
+		return 1;
+	}
+	if (context->option_watch) watch_add_directory(path);
+	char *buffer = malloc(DFS_BUFFER_CAPACITY);
+	if (!buffer) {
+		close(fd);
+		printf_error("Out of memory");
+		return 1;
+	}
+
+	dfs_frame frame = {
+		.fd = fd,
+		.offset = 0,
+		.path_len = path_len,
+		.buffer = buffer,
+		.nread = 0,
+		.bpos = 0,
+		.batch = {0},
+	};
+	stack[(*depth)++] = frame;
+	*open_fds += 1;
+	return 0;
+}
+
+struct linux_dirent64 *paths_traverse_next(dfs_frame *frame, string path, int *open_fds) {
+
+	if (frame->fd < 0) {
+		// closed for the fd budget, continue from where it was left
+		frame->fd = openat(root_fd, path, O_RDONLY | O_DIRECTORY);
+		if (frame->fd < 0) {
 			errors_count += 1;
 			printf_error_verbose("Error reading '%s'", path);
-		default:
+			return 0;
 		}
+		*open_fds += 1;
+		if (lseek(frame->fd, frame->offset, SEEK_SET) < 0) return 0;
 	}
 
-	// fts_close(tree);
-	return 0;
+	if (frame->bpos >= frame->nread) {
+		STATS_BEGIN(list_start)
+		PROBE_BEGIN(list_probe, list)
+		frame->nread = syscall(SYS_getdents64, frame->fd, frame->buffer, DFS_BUFFER_CAPACITY);
+		STATS_END(list, list_start, 0, frame->nread > 0 ? frame->nread : 0)
+		PROBE(list, path, frame->nread, now_ns() - list_probe)
+		frame->bpos = 0;
+		if (frame->nread <= 0) return 0;
+		paths_stat_batch(frame->fd, frame->buffer, frame->nread, &frame->batch);
+	}
+
+	struct linux_dirent64 *d = (struct linux_dirent64 *)(frame->buffer + frame->bpos);
+	frame->bpos += d->d_reclen;
+	return d;
 }
 
 int paths_bfs() {
-	bfs_queue_capacity = INIT_BFS_QUEUE_CAPACITY;
-	bfs_queue_buffer = calloc(bfs_queue_capacity, 1);
-	bfs_queue_buffer[0] = 0;
-	bfs_queue_start = bfs_queue_buffer;
-	bfs_queue_end = bfs_queue_buffer;
-
 	if (paths_bfs_consume(".")) return 1;
-	while (!paths_bfs_deque()) {}
+	while (!limit_reached() && !paths_bfs_deque()) {}
+
+	while (bfs_queue_head) {
+		bfs_chunk *chunk = bfs_queue_head;
+		bfs_queue_head = chunk->next;
+		free(chunk->data);
+		free(chunk);
+	}
+	bfs_queue_tail = 0;
+	bfs_queue_read = 0;
+	bfs_queue_chunks_in_memory = 0;
 	return 0;
 }
 
-int paths_bfs_enqueue(string path) {
-	size_t path_len = strlen(path);
+// the queue is a list of chunks with records of a kind byte and a string,
+// a parent record holds the path of a directory followed by the names of its subdirectories
+
+#define BFS_PARENT 'p'
+#define BFS_NAME 'n'
+
+int paths_bfs_enqueue(char kind, string text) {
+	size_t record_len = strlen(text) + 2;
+
+	if (!bfs_queue_tail || bfs_queue_tail->size + record_len > BFS_QUEUE_CHUNK_SIZE) {
+		bfs_chunk *chunk = calloc(1, sizeof(bfs_chunk));
+		char *data = malloc(BFS_QUEUE_CHUNK_SIZE);
+		if (!chunk || !data) {
+			printf_error("Out of memory");
+			return 1;
+		}
+		chunk->data = data;
+		chunk->spilled = -1;
 
-	if (bfs_queue_end + path_len + 1 >= bfs_queue_buffer + bfs_queue_capacity) {
-		bfs_queue_capacity *= 2;
-		char *new_buffer = calloc(bfs_queue_capacity, 1);
-		memcpy(new_buffer, bfs_queue_start, bfs_queue_end - bfs_queue_start);
-		bfs_queue_end = new_buffer + (bfs_queue_end - bfs_queue_start);
-		bfs_queue_start = new_buffer;
-		free(bfs_queue_buffer);
-		bfs_queue_buffer = new_buffer;
+		if (bfs_queue_tail) {
+			paths_bfs_spill(bfs_queue_tail);
+			bfs_queue_tail->next = chunk;
+		} else {
+			bfs_queue_head = chunk;
+		}
+		bfs_queue_tail = chunk;
+		bfs_queue_chunks_in_memory += 1;
 	}
 
-	strcpy(bfs_queue_end, path);
-	bfs_queue_end += path_len + 1;
+	char *record = bfs_queue_tail->data + bfs_queue_tail->size;
+	record[0] = kind;
+	strcpy(record + 1, text);
+	bfs_queue_tail->size += record_len;
 
 	return 0;
 }
 
-int paths_bfs_deque() {
-	if (bfs_queue_start[0] == 0) return 1;
+void paths_bfs_spill(bfs_chunk *chunk) {
+	if (bfs_queue_chunks_in_memory < (BFS_QUEUE_MEMORY_CAP) / (BFS_QUEUE_CHUNK_SIZE)) return;
+	if (chunk == bfs_queue_head) return;
 
-	size_t path_len = strlen(bfs_queue_start);
-	string path = bfs_queue_start;
-	bfs_queue_start += path_len + 1;
+	if (bfs_spill_fd < 0) {
+		FILE *spill = tmpfile();
+		if (!spill) return;
+		bfs_spill_fd = fileno(spill);
+	}
+	if (pwrite(bfs_spill_fd, chunk->data, chunk->size, bfs_spill_size) != chunk->size) return;
+
+	chunk->spilled = bfs_spill_size;
+	bfs_spill_size += chunk->size;
+	bfs_spilled_chunks += 1;
+	free(chunk->data);
+	chunk->data = 0;
+	bfs_queue_chunks_in_memory -= 1;
+}
 
-	paths_bfs_consume(path);
+char *paths_bfs_next_record() {
+	while (bfs_queue_head) {
+		bfs_chunk *chunk = bfs_queue_head;
+
+		if (bfs_queue_read < chunk->size) {
+			if (!chunk->data) {
+				chunk->data = malloc(BFS_QUEUE_CHUNK_SIZE);
+				if (!chunk->data || pread(bfs_spill_fd, chunk->data, chunk->size, chunk->spilled) != chunk->size) {
+					printf_error("Failed to read back the directory queue");
+					return 0;
+				}
+				bfs_queue_chunks_in_memory += 1;
+				if (!--bfs_spilled_chunks) {
+					// everything spilled was read back, start the file over
+					if (ftruncate(bfs_spill_fd, 0)) {}
+					bfs_spill_size = 0;
+				}
+			}
+			char *record = chunk->data + bfs_queue_read;
+			bfs_queue_read += strlen(record) + 1;
+			return record;
+		}
+		if (chunk == bfs_queue_tail) return 0;
+
+		// fully consumed
+		bfs_queue_head = chunk->next;
+		bfs_queue_read = 0;
+		bfs_queue_chunks_in_memory -= 1;
+		free(chunk->data);
+		free(chunk);
+	}
 	return 0;
 }
 
+int paths_bfs_deque() {
+	char path[PATH_MAX + 2];
+
+	while (1) {
+		char *record = paths_bfs_next_record();
+		if (!record) return 1;
+
+		if (record[0] == BFS_PARENT) {
+			strcpy(bfs_parent, record + 1);
+			continue;
+		}
+		if (snprintf(path, sizeof(path), "%s/%s", bfs_parent, record + 1) >= sizeof(path)) {
+			errors_count += 1;
+			printf_error_verbose("Path too long '%s/%s'", bfs_parent, record + 1);
+			continue;
+		}
+		paths_bfs_consume(path);
+		return 0;
+	}
+}
+
 int paths_bfs_consume(string path) {
 	char buffer[GETENTS_BUFFER_CAPACITY];
 	char path_buffer[PATH_MAX + 2];
+	char parent_enqueued = 0;
+	stat_batch batch = {0};
 
-	int fd = open(path, O_RDONLY | O_DIRECTORY);
+	int fd = openat(root_fd, path, O_RDONLY | O_DIRECTORY);
+	if (fd >= 0 && context->option_watch) watch_add_directory(path);
 
 	int root_path_len = strlen(path);
 	strcpy(path_buffer, path);
@@ -349,41 +1144,71 @@ int paths_bfs_consume(string path) {
 	basename[-1] = '/';
 
 	int nread;
-	while ((nread = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+	while (!limit_reached()) {
+		STATS_BEGIN(list_start)
+		PROBE_BEGIN(list_probe, list)
+		nread = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+		STATS_END(list, list_start, 0, nread > 0 ? nread : 0)
+		PROBE(list, path, nread, now_ns() - list_probe)
+		if (nread <= 0) break;
+		paths_stat_batch(fd, buffer, nread, &batch);
+
 		for (int bpos = 0, step = 0; bpos < nread; bpos += step) {
 
-			struct linux_dirent64 {
-				unsigned long long d_ino;
-				long long d_off;
-				unsigned short d_reclen;
-				unsigned char d_type;
-				char d_name[];
-			} *d = (struct linux_dirent64 *)(buffer + bpos);
+			struct linux_dirent64 *d = (struct linux_dirent64 *)(buffer + bpos);
 			step = d->d_reclen;
 
+			if (limit_reached()) break;
+
 			string name = d->d_name;
 			if (path_dot(name) || path_ddot(name)) continue;
 
-			char skip = (option_unhidden && path_hidden(name));
+			char skip = (context->option_unhidden && path_hidden(name));
 			if (skip) continue;
 
 			// construct path_buffer
 			strcpy(basename, name);
 
+			struct stat st = {0};
+			if (metadata_needed(d->d_type) && d->d_type != DT_UNKNOWN && paths_stat(fd, name, bpos, &batch, &st)) {
+				errors_count += 1;
+				printf_error_verbose("Error reading '%s'", path_buffer);
+				continue;
+			}
+
 			if (d->d_type == DT_DIR) {
 				if (skip || skip_directory(name)) continue;
+				if (!match_directory_metadata(&st)) continue;
+				if (context->option_unique && !paths_visit_directory(fd, name, path_buffer)) continue;
 				handle_directory(path_buffer + 2, name);
-				paths_bfs_enqueue(path_buffer);
+				if (!parent_enqueued) {
+					paths_bfs_enqueue(BFS_PARENT, path);
+					parent_enqueued = 1;
+				}
+				paths_bfs_enqueue(BFS_NAME, name);
 
 			} else if (d->d_type == DT_REG) {
-				handle_path(path_buffer + 2);
+				handle_file(path_buffer + 2, name, &st);
 			}
 		}
 	}
 	close(fd);
+	stat_batch_free(&batch);
+	if (context->option_stats) stats.list.count += 1;
 	return 0;
 }
 
+char paths_visit_directory(int parent_fd, string name, string path) {
+	struct stat st;
+
+	if (fstatat(parent_fd, name, &st, 0)) {
+		errors_count += 1;
+		printf_error_verbose("Error reading '%s'", path);
+		return 0;
+	}
+	return inode_visit_directory(&st);
+}
+
 int paths_read() {
 	char buffer[PATH_MAX + 2];
 
@@ -391,7 +1216,7 @@ int paths_read() {
 	size_t len = 0;
 	ssize_t read;
 
-	while ((read = getline(&line, &len, stdin)) != -1) {
+	while (!limit_reached() && (read = getline(&line, &len, stdin)) != -1) {
 		if (read > 0 && line[read - 1] == '\n') {
 			line[read - 1] = '\0';
 		}
@@ -411,158 +1236,569 @@ char skip_directory(const char *name) {
 		   str_equals(name, "dist");
 }
 
-// === handlers
+// === pipeline
 
-void handle_path(string path) {
-	struct stat st;
+// with -P a thread traverses and passes the files through a single producer single consumer ring,
+// the calling thread opens, reads and searches them, it blocks only with the ring empty and no reads pending
 
-	if (stat(path, &st) == -1) {
-		perror("stat");
-		return;
+int pipeline_run() {
+
+	if (!pipeline.slots) {
+		pipeline.slots = malloc(PIPELINE_SLOTS * sizeof(pipeline_slot));
+		if (!pipeline.slots) {
+			printf_error("Out of memory");
+			return 1;
+		}
+	}
+	pipeline.head = 0;
+	pipeline.tail = 0;
+	if (pthread_create(&pipeline.thread, 0, pipeline_traverse, 0)) {
+		// searched as without -P
+		context->option_pipeline = 0;
+		return paths_handle();
 	}
 
-	if (S_ISREG(st.st_mode)) {
-		string name = basename_pointer(path);
-		filemode mode = st.st_mode;
-		filesize size = st.st_size;
-		handle_file(path, name, mode, size);
+	while (1) {
+		unsigned int head = pipeline.head;
+		if (head == __atomic_load_n(&pipeline.tail, __ATOMIC_ACQUIRE)) {
+			if (context->files_count) {
+				// keep searching the loaded files meanwhile
+				if (handle_content_result()) context->files_count -= 1;
+			} else {
+				pipeline_wait(&pipeline.tail, &pipeline.tail_waiting, head);
+			}
+			continue;
+		}
 
-	} else if (S_ISDIR(st.st_mode)) {
-		string name = basename_pointer(path);
-		handle_directory(path, name);
+		pipeline_slot *slot = pipeline.slots + head % PIPELINE_SLOTS;
+		if (!slot->path) break;
+		if (!limit_reached()) handle_matched_file(slot->path, basename_pointer(slot->path), &slot->st);
+		if (slot->path != slot->inline_path) free(slot->path);
+
+		__atomic_store_n(&pipeline.head, head + 1, __ATOMIC_SEQ_CST);
+		pipeline_wake(&pipeline.head, &pipeline.head_waiting);
 	}
+
+	pthread_join(pipeline.thread, 0);
+	errors_count += pipeline.errors;
+	return pipeline.result;
 }
 
-inline string basename_pointer(string path) {
-	string sep = strrchr(path, '/');
-	if (!sep) return path;
-	return sep + 1;
+void *pipeline_traverse(void *arg) {
+	pipeline_traversing = 1;
+	pipeline.result = paths_handle();
+	pipeline.errors = errors_count;
+	pipeline_push(0, 0);
+	return 0;
 }
 
-void handle_directory(string path, string name) {
+void pipeline_push(string path, struct stat *st) {
 
-	if (option_name_omit) return;
-	if (!str_contains("ad", option_file_type)) return;
-	if (path_dot(name)) return;
-	if (!match_name(name)) return;
+	unsigned int tail = pipeline.tail;
+	while (tail - __atomic_load_n(&pipeline.head, __ATOMIC_ACQUIRE) == PIPELINE_SLOTS) {
+		pipeline_wait(&pipeline.head, &pipeline.head_waiting, tail - PIPELINE_SLOTS);
+	}
 
-	if (content_patterns_len) return;
+	pipeline_slot *slot = pipeline.slots + tail % PIPELINE_SLOTS;
+	slot->path = 0;
+	if (path) {
+		size_t len = strlen(path);
+		slot->path = len < PIPELINE_PATH_LEN ? slot->inline_path : malloc(len + 1);
+		if (!slot->path) {
+			errors_count += 1;
+			printf_error("Out of memory");
+			return;
+		}
+		memcpy(slot->path, path, len + 1);
+		slot->st = *st;
+	}
 
-	print_match_path(path);
+	__atomic_store_n(&pipeline.tail, tail + 1, __ATOMIC_SEQ_CST);
+	pipeline_wake(&pipeline.tail, &pipeline.tail_waiting);
 }
 
-void handle_file(string path, string name, filemode mode, filesize size) {
-
-	if (!str_contains("afetb", option_file_type)) return;
-	if (!implies(option_file_type == 'e', mode & S_IXUSR)) return;
-	if (!match_name(name)) return;
-
-	if (content_patterns_len == 0 && !str_contains("tb", option_file_type)) {
-		print_match_path(path);
-	} else {
-		handle_content(path, name, mode, size);
+void pipeline_wait(unsigned int *counter, unsigned int *waiting, unsigned int seen) {
+	// the waker checks the flag after moving the counter, the futex sleeps only if it did not move yet
+	__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) == seen) {
+		syscall(SYS_futex, counter, FUTEX_WAIT_PRIVATE, seen, 0, 0, 0);
 	}
+	__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
 }
 
-// === content
-
-int init_loading() {
-	// sizeof(files);
+void pipeline_wake(unsigned int *counter, unsigned int *waiting) {
+	if (!__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) return;
+	syscall(SYS_futex, counter, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+}
 
-	fixed_buffers = malloc(FILE_ENTRIES * FIXED_BUFFER_SIZE);
-	if (!fixed_buffers) {
-		printf_error("Out of memory");
-		return 1;
-	}
+// === metadata
 
-	io_uring_queue_init(FILE_ENTRIES, &ring, 0);
+void init_metadata() {
+	context->metadata_files = context->option_size.over != LLONG_MIN || context->option_size.upto != LLONG_MAX ||
+					 context->option_age.over != LLONG_MIN || context->option_age.upto != LLONG_MAX;
+	context->metadata_directories = context->option_directory_age.over != LLONG_MIN || context->option_directory_age.upto != LLONG_MAX;
+	metadata_refresh();
+}
 
-	for_each(i, FILE_ENTRIES) {
+void metadata_refresh() {
+	// the ages are relative to the start of the query, or of the batch of watched events
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	metadata_now = ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
 
-		file_buffer buffer = {
-			.start = fixed_buffers + i * FIXED_BUFFER_SIZE,
-			.size = 0,
-			.capacity = FIXED_BUFFER_SIZE,
-			.owned = 0,
-		};
-		file_entry file = {
-			.fixed_buffer = buffer,
-			.buffer = buffer,
-			.ready = 1,
-		};
-		files[i] = file;
-	}
+char match_metadata(struct stat *st) {
+	if (!context->metadata_files) return 1;
 
+	long long age = metadata_now - (long long)stat_mtime_ns(st);
+	if (range_contains(context->option_size, st->st_size) && range_contains(context->option_age, age)) return 1;
+	if (context->option_stats) __atomic_fetch_add(&stats.metadata_skips, 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
-void loading_submit_file(file_entry *file) {
-
-	file->iov.iov_base = file->buffer.start;
-	file->iov.iov_len = file->buffer.capacity;
+char match_directory_metadata(struct stat *st) {
+	if (!context->metadata_directories) return 1;
 
-	struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-	io_uring_prep_readv(sqe, file->fd, &file->iov, 1, 0);
-	io_uring_sqe_set_data(sqe, file);
-	io_uring_submit(&ring);
+	long long age = metadata_now - (long long)stat_mtime_ns(st);
+	if (range_contains(context->option_directory_age, age)) return 1;
+	if (context->option_stats) __atomic_fetch_add(&stats.metadata_skips, 1, __ATOMIC_RELAXED);
+	return 0;
 }
-file_entry *loading_get_file() {
-
-	struct io_uring_cqe *cqe;
-	io_uring_wait_cqe(&ring, &cqe);
 
-	file_entry *file = io_uring_cqe_get_data(cqe);
-	file->buffer.size = cqe->res;
-	io_uring_cqe_seen(&ring, cqe);
+char metadata_needed(unsigned char type) {
+	// the type from getdents decides without a stat whenever it can
+	if (type == DT_UNKNOWN) return 1;
+	if (type == DT_DIR) return context->metadata_directories;
+	if (type == DT_REG) return str_contains("afetb", context->option_file_type) && (!context->skip_loading || context->option_unique || context->metadata_files);
+	return 0;
+}
 
-	return file;
+int metadata_ring_init() {
+	if (!metadata_ring_state) metadata_ring_state = io_uring_queue_init(METADATA_BATCH, &metadata_ring, 0) ? 'f' : 'r';
+	return metadata_ring_state != 'r';
 }
 
-file_entry *get_ready_file_entry() {
-	if (files_count < FILE_ENTRIES) {
-		for_each(i, FILE_ENTRIES) {
-			if (files[i].ready) {
-				files_count += 1;
-				return files + i;
-			}
+void paths_stat_batch(int dir_fd, char *buffer, int nread, stat_batch *batch) {
+	batch->len = 0;
+	batch->next = 0;
+	// only the predicates stat every entry, the other searches keep the stat of each file
+	if (!context->metadata_files && !context->metadata_directories) return;
+	if (metadata_ring_init()) return;
+
+	struct statx results[METADATA_BATCH];
+	int positions[METADATA_BATCH];
+	int pending = 0;
+
+	STATS_BEGIN(stat_start)
+	for (int bpos = 0, step = 0; bpos < nread; bpos += step) {
+		struct linux_dirent64 *d = (struct linux_dirent64 *)(buffer + bpos);
+		step = d->d_reclen;
+
+		string name = d->d_name;
+		if (path_dot(name) || path_ddot(name)) continue;
+		if (context->option_unhidden && path_hidden(name)) continue;
+		if (!metadata_needed(d->d_type)) continue;
+
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&metadata_ring);
+		io_uring_prep_statx(sqe, dir_fd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, results + pending);
+		io_uring_sqe_set_data64(sqe, pending);
+		positions[pending++] = bpos;
+
+		if (pending == METADATA_BATCH) {
+			if (paths_stat_complete(batch, results, positions, pending)) return;
+			pending = 0;
 		}
 	}
-	while (1) {
-		file_entry *file = handle_content_result();
-		if (file) return file;
-	}
+	if (pending) paths_stat_complete(batch, results, positions, pending);
+	STATS_END(stat, stat_start, batch->len, 0)
+}
+
+int paths_stat_complete(stat_batch *batch, struct statx *results, int *positions, int pending) {
+
+	if (batch->len + pending > batch->capacity) {
+		size_t capacity = max(batch->capacity * 2, batch->len + pending);
+		struct stat *stats = realloc(batch->stats, capacity * sizeof(struct stat));
+		if (stats) batch->stats = stats;
+		int *grown = realloc(batch->positions, capacity * sizeof(int));
+		if (grown) batch->positions = grown;
+		if (!stats || !grown) {
+			printf_error("Out of memory");
+			return 1;
+		}
+		batch->capacity = capacity;
+	}
+
+	io_uring_submit_and_wait(&metadata_ring, pending);
+	for_each(i, pending) {
+		struct io_uring_cqe *cqe;
+		if (io_uring_wait_cqe(&metadata_ring, &cqe) || !cqe) return 1;
+		size_t k = io_uring_cqe_get_data64(cqe);
+		struct stat *st = batch->stats + batch->len + k;
+		memset(st, 0, sizeof(struct stat));
+		if (cqe->res >= 0) statx_to_stat(results + k, st);
+		// older kernels without the statx op, the entries fall back to fstatat
+		if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) metadata_ring_state = 'f';
+		io_uring_cqe_seen(&metadata_ring, cqe);
+	}
+	memcpy(batch->positions + batch->len, positions, pending * sizeof(int));
+	batch->len += pending;
+	return 0;
+}
+
+int paths_stat(int dir_fd, string name, int position, stat_batch *batch, struct stat *st) {
+
+	// the batch is in the order of the buffer, as the entries are consumed
+	while (batch->next < batch->len && batch->positions[batch->next] < position) batch->next += 1;
+	if (batch->next < batch->len && batch->positions[batch->next] == position) {
+		*st = batch->stats[batch->next++];
+		if (st->st_mode) return 0;
+		// failed in the batch, the error of the syscall is the one that counts
+	}
+	return fstatat(dir_fd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+void statx_to_stat(struct statx *sx, struct stat *st) {
+	st->st_dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+	st->st_ino = sx->stx_ino;
+	st->st_mode = sx->stx_mode;
+	st->st_nlink = sx->stx_nlink;
+	st->st_uid = sx->stx_uid;
+	st->st_gid = sx->stx_gid;
+	st->st_size = sx->stx_size;
+	st->st_blksize = sx->stx_blksize;
+	st->st_blocks = sx->stx_blocks;
+	st->st_mtim.tv_sec = sx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+}
+
+void stat_batch_free(stat_batch *batch) {
+	free(batch->stats);
+	free(batch->positions);
+	batch->stats = 0;
+	batch->positions = 0;
+	batch->capacity = 0;
+	batch->len = 0;
+}
+
+// === handlers
+
+void handle_path(string path) {
+	struct stat st;
+
+	if (fstatat(root_fd, path, &st, 0) == -1) {
+		perror("stat");
+		return;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		string name = basename_pointer(path);
+		handle_file(path, name, &st);
+
+	} else if (S_ISDIR(st.st_mode)) {
+		if (!match_directory_metadata(&st)) return;
+		if (context->option_unique && !inode_visit_directory(&st)) return;
+		string name = basename_pointer(path);
+		handle_directory(path, name);
+	}
+}
+
+inline string basename_pointer(string path) {
+	string sep = strrchr(path, '/');
+	if (!sep) return path;
+	return sep + 1;
+}
+
+void handle_directory(string path, string name) {
+
+	if (limit_reached()) return;
+	if (context->option_name_omit) return;
+	if (!str_contains("ad", context->option_file_type)) return;
+	if (path_dot(name)) return;
+	if (!match_name(name)) return;
+
+	if (context->content_patterns_len) return;
+
+	print_match_path(path);
+}
+
+void handle_file(string path, string name, struct stat *st) {
+
+	if (limit_reached()) return;
+	if (!str_contains("afetb", context->option_file_type)) return;
+	if (!implies(context->option_file_type == 'e', st->st_mode & S_IXUSR)) return;
+	if (!match_name(name)) return;
+	if (!match_metadata(st)) return;
+	if (pipeline_traversing) {
+		pipeline_push(path, st);
+	} else {
+		handle_matched_file(path, name, st);
+	}
+}
+
+void handle_matched_file(string path, string name, struct stat *st) {
+
+	// with files waiting in the reorder window, the output found without reading waits behind them,
+	// the other paths of a file already matched too
+	FILE *previous = output;
+	scheduled_file *held = context->option_disk_order ? schedule_hold() : 0;
+	if (held) output = held->stream;
+
+	if (context->option_unique && !inode_visit_file(path, st)) {
+		output = previous;
+		if (held) schedule_release(held);
+		return;
+	}
+	if (context->option_watch) watch_track_file(path, st);
+
+	int cached;
+	if (context->content_patterns_len == 0 && !str_contains("tb", context->option_file_type)) {
+		print_match_path(path);
+		if (context->option_unique) inode_resolve(st->st_dev, st->st_ino, 1);
+	} else if (class_binary(name)) {
+		// known binary without reading it, only a listing of binaries outputs it
+		if (context->option_stats) stats.class_skips += 1;
+		if (context->option_file_type == 'b') print_match_path(path);
+		if (context->option_unique) inode_resolve(st->st_dev, st->st_ino, context->option_file_type == 'b');
+	} else if (context->option_result_cache && (cached = result_cache_replay(path, st)) >= 0) {
+		if (context->option_unique) inode_resolve(st->st_dev, st->st_ino, cached);
+	} else {
+		output = previous;
+		if (held) schedule_release(held);
+		held = 0;
+		handle_content(path, name, st);
+	}
+	output = previous;
+	if (held) schedule_release(held);
+}
+
+// === content
+
+int init_loading() {
+
+	// probes only need the bytes of the binary check, pack more of them in the same memory
+	size_t buffer_size = context->probe_loading ? (PROBE_BUFFER_SIZE) : (FIXED_BUFFER_SIZE);
+	context->files_capacity = (FILE_ENTRIES) * (FIXED_BUFFER_SIZE) / buffer_size;
+
+	context->files = calloc(context->files_capacity, sizeof(file_entry));
+	if (posix_memalign((void **)&context->fixed_buffers, DIRECT_READ_ALIGN, context->files_capacity * buffer_size)) {
+		context->fixed_buffers = 0;
+	}
+	if (!context->files || !context->fixed_buffers) {
+		printf_error("Out of memory");
+		return 1;
+	}
+
+	io_uring_queue_init(context->files_capacity, &context->ring, 0);
+
+	for_each(i, context->files_capacity) {
+
+		file_buffer buffer = {
+			.start = context->fixed_buffers + i * buffer_size,
+			.size = 0,
+			.capacity = buffer_size,
+			.owned = 0,
+		};
+		file_entry file = {
+			.fixed_buffer = buffer,
+			.buffer = buffer,
+			.ready = 1,
+		};
+		context->files[i] = file;
+	}
+
+	return 0;
+}
+
+void loading_submit_file(file_entry *file) {
+
+	// continues after what was read before, a single read stops short of 2 GiB
+	file->iov.iov_base = file->buffer.start + file->buffer.size;
+	file->iov.iov_len = file->buffer.capacity - file->buffer.size;
+
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&context->ring);
+	io_uring_prep_readv(sqe, file->fd, &file->iov, 1, file->buffer.size);
+	sqe->rw_flags = file->nowait ? RWF_NOWAIT : 0;
+	io_uring_sqe_set_data(sqe, file);
+	if (context->option_stats || PROBE_ENABLED(read)) file->submitted = now_ns();
+	PROBE(submit, file->path, file->size, file->iov.iov_len)
+	io_uring_submit(&context->ring);
+}
+file_entry *loading_get_file() {
+
+	struct io_uring_cqe *cqe;
+	file_entry *file;
+	STATS_BEGIN(wait_start)
+	while (1) {
+		io_uring_wait_cqe(&context->ring, &cqe);
+		file = io_uring_cqe_get_data(cqe);
+		if (!file) {
+			io_uring_cqe_seen(&context->ring, cqe); // completion of a cancel request
+			continue;
+		}
+		int res = cqe->res;
+		io_uring_cqe_seen(&context->ring, cqe);
+		if (res >= 0) {
+			file->buffer.size += res;
+		} else if (res != -EAGAIN || !file->buffer.size) {
+			// a read that would block after the first is retried from what was read
+			file->buffer.size = res;
+		}
+		PROBE(read, file->path, file->size, res, now_ns() - file->submitted)
+
+		if (context->option_stats) {
+			stats_record(&stats.read, wait_start, 1, res > 0 ? res : 0);
+			stats_record_latency(now_ns() - file->submitted);
+		}
+
+		// the whole file is read into an owned buffer, each read is capped
+		if (file->buffer.owned && res > 0 && file->buffer.size < file->size) {
+			loading_submit_file(file);
+			if (context->option_stats) wait_start = now_ns();
+			continue;
+		}
+		return file;
+	}
+}
+
+void loading_cancel() {
+	if (context->skip_loading) return;
+
+	for_each(i, context->files_capacity) {
+		if (context->files[i].ready) continue;
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&context->ring);
+		io_uring_prep_cancel(sqe, context->files + i, 0);
+		io_uring_sqe_set_data(sqe, 0);
+	}
+	io_uring_submit(&context->ring);
+}
+
+file_entry *get_ready_file_entry() {
+	if (context->files_count < context->files_capacity) {
+		for_each(i, context->files_capacity) {
+			if (context->files[i].ready) {
+				context->files_count += 1;
+				return context->files + i;
+			}
+		}
+	}
+	while (1) {
+		file_entry *file = handle_content_result();
+		if (file) return file;
+	}
+}
+
+void root_path(char *buffer, string path) {
+	if (!roots_count) {
+		strcpy(buffer, path);
+	} else {
+		const char *sep = roots[roots_index][strlen(roots[roots_index]) - 1] == '/' ? "" : "/";
+		sprintf(buffer, "%s%s%s", roots[roots_index], sep, path);
+	}
+}
+
+void loading_dispose_file(file_entry *file) {
+	if (context->option_result_cache) result_cache_store(file);
+	if (context->option_unique) inode_resolve(file->dev, file->ino, file->matched);
+
+	if (context->option_no_cache && !file->cached && !file->direct && !file->unknown) {
+		posix_fadvise(file->fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	close(file->fd);
+	if (file->buffer.owned) free(file->buffer.start);
+	file->ready = 1;
 }
 
 void handle_last_content_loaded() {
-	while (files_count) {
+	if (context->option_disk_order) schedule_flush();
+	loading_drain();
+}
+
+void loading_drain() {
+	while (context->files_count) {
 		file_entry *file = handle_content_result();
-		if (file) files_count -= 1;
+		if (file) context->files_count -= 1;
 	}
 }
 
-file_entry *handle_content(string path, string name, filemode mode, filesize size) {
+file_entry *handle_content(string path, string name, struct stat *st) {
+
+	if (context->option_disk_order) {
+		schedule_file(path, st);
+		return 0;
+	}
 
-	int fd = open(path, O_RDONLY);
+	char direct;
+	int fd = content_open(path, st, &direct);
 	if (fd < 0) {
-		errors_count += 1;
+		if (context->option_unique) inode_resolve(st->st_dev, st->st_ino, 0);
 		return 0;
 	}
+	char residency = context->option_no_cache && !direct ? content_residency(fd) : S_resident;
+	if (residency == S_cold) {
+		// start reading ahead while waiting for a ready file entry, after the residency is known
+		posix_fadvise(fd, 0, min(st->st_size, FIXED_BUFFER_SIZE), POSIX_FADV_WILLNEED);
+	}
+	return content_submit(fd, direct, residency, path, st);
+}
+
+char content_residency(int fd) {
+	// the first page, a read that would block fails instead, other failures tell nothing
+	char byte;
+	struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+	if (preadv2(fd, &iov, 1, 0, RWF_NOWAIT) >= 0) return S_resident;
+	return errno == EAGAIN ? S_cold : S_unknown;
+}
+
+int content_open(string path, struct stat *st, char *direct) {
+
+	*direct = context->option_no_cache && !context->probe_loading && st->st_size >= DIRECT_READ_THRESHOLD;
+
+	STATS_BEGIN(open_start)
+	int fd = openat(root_fd, path, O_RDONLY | (*direct ? O_DIRECT : 0));
+	if (fd < 0 && *direct) {
+		// not supported by the filesystem
+		*direct = 0;
+		fd = openat(root_fd, path, O_RDONLY);
+	}
+	STATS_END(open, open_start, 1, 0)
+	if (fd < 0) errors_count += 1;
+	return fd;
+}
 
+file_entry *content_submit(int fd, char direct, char residency, string path, struct stat *st) {
+
+	filesize size = st->st_size;
 	file_entry *file = get_ready_file_entry();
 	// file_entry create
 	file->ready = 0;
 	file->fd = fd;
-	file->mode = mode;
+	file->mode = st->st_mode;
 	file->size = size;
+	file->dev = st->st_dev;
+	file->ino = st->st_ino;
+	file->mtime = stat_mtime_ns(st);
+	file->matched = 0;
 	file->buffer = file->fixed_buffer;
-
-	if (!roots_count) {
-		strcpy(file->path, path);
-	} else {
-		const char *sep = roots[roots_index][strlen(roots[roots_index]) - 1] == '/' ? "" : "/";
-		sprintf(file->path, "%s%s%s", roots[roots_index], sep, path);
+	file->nowait = 0;
+	file->cached = 0;
+	file->unknown = residency == S_unknown;
+	file->direct = direct;
+	file->compression = 0;
+	file->scheduled = 0;
+
+	if (context->probe_loading) {
+		// read only what check_binary looks at, try the page cache first
+		file->buffer.capacity = min(size, BINARY_CHECK_LEN) + 1;
+		file->nowait = 1;
+	}
+	if (context->option_no_cache && !direct && residency == S_resident) {
+		// files already in the page cache are left there
+		file->nowait = 1;
+		file->cached = 1;
 	}
 
+	root_path(file->path, path);
+
 	loading_submit_file(file);
 	return file;
 }
@@ -570,7 +1806,14 @@ file_entry *handle_content(string path, string name, filemode mode, filesize siz
 file_entry *handle_content_overflow(file_entry *file) {
 
 	filesize capacity = file->size + 2;
-	char *start = malloc(capacity);
+	char *start;
+	if (file->direct) {
+		capacity = (capacity + DIRECT_READ_ALIGN - 1) / DIRECT_READ_ALIGN * DIRECT_READ_ALIGN;
+		start = aligned_alloc(DIRECT_READ_ALIGN, capacity);
+	} else {
+		start = malloc(capacity);
+		if (context->option_no_cache) posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
 	if (!start) {
 		printf_error("Out of memory");
 		return 0;
@@ -582,18 +1825,117 @@ file_entry *handle_content_overflow(file_entry *file) {
 		.owned = 1,
 	};
 	file->ready = 0;
+	// only the first chunk was found cached, the rest is checked the same way, clearing cached when it is not
+	file->nowait = file->cached;
 	file->buffer = buffer;
 
+	if (context->option_stats) {
+		stats.overflow.count += 1;
+		stats.overflow.bytes += file->size;
+	}
+	PROBE(overflow, file->path, file->size)
 	loading_submit_file(file);
 	return file;
 }
 
+char handle_content_sparse(file_entry *file) {
+
+	if (file->size < SPARSE_READ_THRESHOLD) return 0;
+	int fd = file->fd;
+	off_t first_hole = lseek(fd, 0, SEEK_HOLE);
+	if (first_hole < 0 || first_hole >= file->size) return 0; // not supported, or no holes
+
+	// the data extents are kept apart by a zero byte for each hole, the lines and matches are the same
+	filesize data = 0;
+	size_t extents = 0;
+	off_t end = 0;
+	for (off_t start = lseek(fd, 0, SEEK_DATA); start >= 0 && start < file->size; start = lseek(fd, end, SEEK_DATA)) {
+		end = lseek(fd, start, SEEK_HOLE);
+		if (end < 0) return 0;
+		data += end - start;
+		extents += 1;
+	}
+	if (file->direct) {
+		// the extents land at unaligned offsets of the buffer
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT)) return 0;
+		file->direct = 0;
+	}
+
+	filesize capacity = data + extents + 2;
+	char *start = malloc(capacity);
+	if (!start) return 0;
+
+	STATS_BEGIN(sparse_start)
+	filesize len = 0;
+	off_t previous = 0;
+	for (off_t from = lseek(fd, 0, SEEK_DATA); from >= 0 && from < file->size; from = lseek(fd, previous, SEEK_DATA)) {
+		off_t to = lseek(fd, from, SEEK_HOLE);
+		if (to < 0) break;
+		if (from > previous && len < capacity - 1) start[len++] = 0;
+		// bounded by the sizes counted before, the file may have grown since
+		for (off_t offset = from; offset < to && len < capacity - 1;) {
+			ssize_t read = pread(fd, start + len, min(to - offset, capacity - 1 - len), offset);
+			if (read <= 0) break;
+			offset += read;
+			len += read;
+		}
+		previous = to;
+	}
+	if (previous < file->size && len < capacity - 1) start[len++] = 0;
+	start[len] = 0;
+	STATS_END(sparse, sparse_start, 1, len)
+	if (context->option_stats) stats.hole_bytes += file->size - min(data, file->size);
+	PROBE(overflow, file->path, file->size)
+
+	if (file->buffer.owned) free(file->buffer.start);
+	file_buffer buffer = {
+		.start = start,
+		.size = len,
+		.capacity = capacity,
+		.owned = 1,
+	};
+	file->buffer = buffer;
+	return 1;
+}
+
 file_entry *handle_content_result() {
 
 	file_entry *file = loading_get_file();
 
+	// output of reordered files is kept until the files before them are done
+	FILE *previous = output;
+	if (file->scheduled) output = file->scheduled->stream;
+	file_entry *done = handle_content_loaded(file);
+	output = previous;
+	return done;
+}
+
+file_entry *handle_content_loaded(file_entry *file) {
+
+	size_t matches_before = matches_count;
+	if (context->option_result_cache) result_capture_begin();
+
+	if (file->nowait && !limit_reached()) {
+		filesize expected = min(file->size, file->buffer.capacity);
+		if (file->buffer.size == -EAGAIN || (file->buffer.size >= 0 && file->buffer.size < expected)) {
+			// not or partially cached, retry with a blocking read from what was read
+			if (file->buffer.size < 0) file->buffer.size = 0;
+			file->nowait = 0;
+			file->cached = 0;
+			loading_submit_file(file);
+			return 0;
+		}
+	}
+
+	if (file->buffer.size < 0 || limit_reached()) {
+		// read failed or got cancelled, drain without searching
+		if (file->buffer.size < 0 && file->buffer.size != -ECANCELED) errors_count += 1;
+		loading_dispose_file(file);
+		return file;
+	}
+
 	char *content = file->buffer.start;
-	int content_len = 0;
+	filesize content_len = 0;
 
 	char overflow = 0;
 	if (file->buffer.size < file->buffer.capacity) {
@@ -605,28 +1947,52 @@ file_entry *handle_content_result() {
 	content[content_len] = 0;
 
 	char skip_checks = file->buffer.owned;
+	if (context->option_decompress && !skip_checks) {
+		file->compression = check_compression(content, content_len);
+	}
+	if (file->compression) {
+		if (overflow) {
+			if (handle_content_overflow(file)) return 0;
+		} else {
+			handle_decompress(file);
+		}
+		if (matches_count != matches_before) file->matched = 1;
+		loading_dispose_file(file);
+		return file;
+	}
+
+	STATS_BEGIN(binary_start)
 	char binary = skip_checks ? 0 : check_binary(content, content_len);
+	STATS_END(binary, binary_start, !skip_checks, skip_checks ? 0 : min(content_len, BINARY_CHECK_LEN))
+	if (context->option_stats && binary) stats.binary_skips += 1;
+	if (context->option_learn && !skip_checks) class_learn(file->path, binary);
 
 	if (binary) {
-		if (option_file_type == 'b') {
+		PROBE(binary, file->path, file->size, min(content_len, BINARY_CHECK_LEN))
+		if (context->option_file_type == 'b') {
 			print_match(file);
 		}
 	} else {
-		if (content_patterns_len) {
+		if (context->content_patterns_len) {
+			if (overflow && handle_content_sparse(file)) {
+				// read without the holes
+				overflow = 0;
+			}
 			if (overflow) {
 				if (handle_content_overflow(file)) return 0;
 			} else {
+				STATS_BEGIN(search_start)
+				nanos output_time = stats.output.time;
 				handle_search(file);
+				STATS_END(search, search_start - (stats.output.time - output_time), 1, file->buffer.size)
 			}
-		} else if (option_file_type == 't') {
+		} else if (context->option_file_type == 't') {
 			print_match(file);
 		}
 	}
 
-	// file_entry dispose
-	close(file->fd);
-	if (file->buffer.owned) free(file->buffer.start);
-	file->ready = 1;
+	if (matches_count != matches_before) file->matched = 1;
+	loading_dispose_file(file);
 
 	return file;
 }
@@ -665,20 +2031,75 @@ void *memchr_end(void *s, int c, void *e) {
 
 void handle_search(file_entry *file) {
 
+	PROBE_BEGIN(search_probe, search_end)
+	PROBE_KEEP(size_t, matches_before, matches_count)
+	PROBE(search_start, file->path, file->buffer.size)
+	search_file(file);
+	PROBE(search_end, file->path, file->buffer.size, matches_count - matches_before, now_ns() - search_probe)
+}
+
+void search_file(file_entry *file) {
+
+	if (context->content_terms_len && !search_terms(file, file->buffer.start, file->buffer.start + file->buffer.size)) return;
+
+	// the parallel regions keep one match for each line, counting every match needs the whole file
+	char parallel_count = !context->option_count || !context->option_content_only;
+	if (context->option_parallel && file->buffer.size >= PARALLEL_SEARCH_THRESHOLD && !context->option_query && !context->dump_files && parallel_count && !patterns_span_lines()) {
+		parallel_search_file(file);
+		return;
+	}
+
 	char *const text = file->buffer.start;
-	filesize const text_len = file->buffer.size;
-	char *const text_end = text + text_len;
+	search_state state = {.line = 1};
+
+	search_text(file, text, text, text + file->buffer.size, &state);
+	if (context->option_count) print_count(file, state.matches);
+}
+
+char search_terms(file_entry *file, char *text, char *text_end) {
+
+	// the most likely to fail first, the rest is not searched for a rejected file
+	char positives = 0, any = 0;
+	for_each(i, context->content_terms_len) {
+		pattern *p = context->content_terms[i];
+		if (!p->negated) {
+			positives = 1;
+			if (any) continue;
+		}
+		pattern_rewind(p);
+		char found = match_pattern(p, text, text_end);
+		if (p->negated && found) return 0;
+		if (!p->negated && !found && context->option_content_all) return 0;
+		if (!p->negated && found && !context->option_content_all) any = 1;
+	}
+	if (positives && !context->option_content_all && !any) return 0;
+
+	// the file is the answer, when there are no lines to output
+	if (context->option_query || !positives) {
+		print_match(file);
+		return 0;
+	}
+	return 1;
+}
 
-	if (content_patterns_len == 1 && content_patterns[0].type == T_star) {
-		if (option_query) {
+void search_text(file_entry *file, char *text, char *cursor, char *const text_end, search_state *state) {
+
+	if (context->option_count) {
+		search_count(cursor, text_end, state);
+		return;
+	}
+	if (context->content_patterns_len == 1 && context->content_patterns[0].type == T_star) {
+		if (context->option_query) {
 			print_match(file);
+			state->done = 1;
 		} else {
-			dump_file(file);
+			state->line = dump_text(file, state->line, cursor, text_end);
+			if (!state->matches++) count_match();
 		}
 		return;
 	}
 
-	int around_lines = option_content_around * 2;
+	int around_lines = context->option_content_around * 2;
 
 	int line_traces_capacity = around_lines * 2;
 	char *line_traces[line_traces_capacity];
@@ -687,18 +2108,31 @@ void handle_search(file_entry *file) {
 
 #define LINE_TRACES(X) line_traces[(X) % line_traces_capacity]
 
-	char *cursor = text;
-	filesize line = 1;
+	filesize line = state->line;
 	char *line_end;
-	int pending_around_lines = 0;
+	int pending_around_lines = state->pending_around_lines;
+
+	if (line_traces_capacity && state->unprinted_lines) {
+		// the lines kept before the cursor from the previous chunk
+		for (char *trace = text; trace < cursor; trace = line_end + 1) {
+			line_end = memchr_end(trace, '\n', cursor);
+			LINE_TRACES(line_traces_index++) = trace;
+			LINE_TRACES(line_traces_index++) = line_end;
+		}
+		line_traces_count = min(state->unprinted_lines, around_lines);
+	}
 
 	char dump = 0;
-	for_each(i, content_patterns_len) {
-		pattern *p = content_patterns + i;
+	for_each(i, context->content_patterns_len) {
+		if (state->presearched) break;
+		pattern *p = context->content_patterns + i;
+		if (p->negated) continue;
 
+		pattern_rewind(p);
 		int success = match_pattern(p, cursor, text_end);
-		if (success && option_query) {
+		if (success && context->option_query) {
 			print_match(file);
+			state->done = 1;
 			return;
 		} else if (p->type == T_star) {
 			dump = 1;
@@ -720,157 +2154,2339 @@ void handle_search(file_entry *file) {
 		line += 1;                                                                    \
 	}
 
-	while (cursor < text_end) {
+	while (cursor < text_end && !limit_reached()) {
+		if (context->option_content_limit && state->matches >= context->option_content_limit) break;
+
+		search_match found;
+		if (state->presearched) {
+			if (!state->found_len) break;
+			found = *state->found++;
+			state->found_len -= 1;
+		} else if (!search_next(context->content_patterns, cursor, text_end, &found)) {
+			break;
+		}
+
+		while (1) {
+			line_end = memchr_end(cursor, '\n', text_end);
+			if (line_end > found.start) break;
+			ADVANCE_CURSOR
+		}
+
+		if (line_traces_capacity && line_traces_count) {
+			for_each(i, line_traces_count) {
+				int offset = line_traces_count - i;
+				print_search_match_around(file, line - offset,
+										  LINE_TRACES(line_traces_index - offset * 2),
+										  LINE_TRACES(line_traces_index - offset * 2 + 1));
+			}
+			line_traces_count = 0;
+		}
+
+		print_search_match(file, line, found.start, found.end, cursor, line_end, found.index);
+		count_match();
+		state->matches += 1;
+		pending_around_lines = around_lines;
+
+		cursor = line_end + 1;
+		line += 1;
+	}
+
+	while ((pending_around_lines || dump) && cursor < text_end) {
+		line_end = memchr_end(cursor, '\n', text_end);
+		ADVANCE_CURSOR
+	}
+
+	state->done = limit_reached() || (context->option_content_limit && state->matches >= context->option_content_limit);
+	if (state->stream && !state->done) {
+		// count the rest of the lines, for the line numbers and the context of the next chunk
+		while (cursor < text_end) {
+			line_end = memchr_end(cursor, '\n', text_end);
+			line_traces_count += 1;
+			cursor = line_end + 1;
+			line += 1;
+		}
+		state->line = line;
+		state->pending_around_lines = pending_around_lines;
+		state->unprinted_lines = min(line_traces_count, around_lines);
+	}
+}
+
+void search_count(char *cursor, char *const text_end, search_state *state) {
+
+	if (context->content_patterns_len == 1 && context->content_patterns[0].type == T_star) {
+		state->matches += count_lines(cursor, text_end);
+		if (cursor < text_end && text_end[-1] != '\n') state->matches += 1;
+		return;
+	}
+
+	for_each(i, context->content_patterns_len) {
+		pattern *p = context->content_patterns + i;
+		if (state->presearched || p->negated) continue;
+		pattern_rewind(p);
+		match_pattern(p, cursor, text_end);
+	}
+
+	// the lines are neither bounded nor numbered, a match skips to the next line, or past it with -o
+	while (cursor < text_end && !limit_reached()) {
+		if (context->option_content_limit && state->matches >= context->option_content_limit) break;
+
+		search_match found;
+		if (state->presearched) {
+			if (!state->found_len) break;
+			found = *state->found++;
+			state->found_len -= 1;
+		} else if (!search_next(context->content_patterns, cursor, text_end, &found)) {
+			break;
+		}
+		state->matches += 1;
+
+		if (context->option_content_only) {
+			cursor = max(found.end, found.start + 1);
+		} else {
+			cursor = (char *)memchr_end(found.start, '\n', text_end) + 1;
+		}
+	}
+	state->done = context->option_content_limit && state->matches >= context->option_content_limit;
+}
+
+char search_next(pattern *patterns, char *cursor, char *text_end, search_match *found) {
+
+	pattern *first = 0;
+	for_each(i, context->content_patterns_len) {
+		pattern *p = patterns + i;
+		if (p->negated) continue;
+
+		while (p->match_start && p->match_start < cursor) {
+			match_pattern(p, cursor, text_end);
+		}
+
+		if (p->match_start && (!first || first->match_start > p->match_start)) {
+			first = p;
+		}
+	}
+	if (!first) return 0;
+
+	found->start = first->match_start;
+	found->end = first->match_end;
+	found->index = first->index;
+	return 1;
+}
+
+char *lines_before(char *text, char *cursor, int lines) {
+	for (int i = 0; i < lines && cursor > text; i++) {
+		char *previous = memrchr(text, '\n', cursor - 1 - text);
+		cursor = previous ? previous + 1 : text;
+	}
+	return cursor;
+}
+
+filesize count_lines(char *cursor, char *text_end) {
+	filesize lines = 0;
+	while ((cursor = memchr(cursor, '\n', text_end - cursor))) {
+		cursor += 1;
+		lines += 1;
+	}
+	return lines;
+}
+
+void parallel_search_file(file_entry *file) {
+
+	char *const text = file->buffer.start;
+	char *const text_end = text + file->buffer.size;
+
+	int threads = max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	size_t regions_len = max(min(threads * PARALLEL_SEARCH_SPLIT, file->buffer.size / (PARALLEL_SEARCH_MIN_REGION)), 1);
+	search_region *regions = calloc(regions_len, sizeof(search_region));
+	if (!regions) {
+		printf_error("Out of memory");
+		return;
+	}
+
+	// split in line aligned regions
+	char *cursor = text;
+	for_each(i, regions_len) {
+		char *end = max(text + file->buffer.size / regions_len * (i + 1), cursor);
+		if (i == regions_len - 1) {
+			end = text_end;
+		} else if (end < text_end) {
+			end = memchr_end(end, '\n', text_end);
+			if (end < text_end) end += 1;
+		}
+		regions[i].start = cursor;
+		regions[i].end = end;
+		cursor = end;
+	}
+
+	parallel_search ps = {
+		.text_end = text_end,
+		.regions = regions,
+		.regions_len = regions_len,
+	};
+	pthread_t workers[threads];
+	int started = 0;
+	while (started < threads - 1 && !pthread_create(workers + started, 0, parallel_search_worker, &ps)) {
+		started += 1;
+	}
+	parallel_search_worker(&ps);
+	for_each(i, started) {
+		pthread_join(workers[i], 0);
+	}
+
+	// print in file order, regions without matches are skipped by their line count
+	int around_lines = context->option_content_around * 2;
+	search_state state = {.line = 1, .stream = 1, .presearched = 1};
+
+	for_each(i, regions_len) {
+		search_region *region = regions + i;
+		if (state.done) break;
+
+		if (!region->found_len && !state.pending_around_lines) {
+			state.line += region->lines;
+			state.unprinted_lines = min(state.unprinted_lines + region->lines, around_lines);
+			continue;
+		}
+		state.found = region->found;
+		state.found_len = region->found_len;
+
+		char *context = lines_before(text, region->start, min(state.unprinted_lines, around_lines));
+		search_text(file, context, region->start, region->end, &state);
+	}
+	if (context->option_count) print_count(file, state.matches);
+
+	for_each(i, regions_len) {
+		free(regions[i].found);
+	}
+	free(regions);
+}
+
+void *parallel_search_worker(void *arg) {
+	parallel_search *ps = arg;
+
+	// own copies of the pattern states, regexes are compiled again to not share their lock
+	pattern patterns[MAX_CONTENT_PATTERNS];
+	memcpy(patterns, context->content_patterns, sizeof(patterns));
+	for_each(i, context->content_patterns_len) {
+		pattern *p = patterns + i;
+		if (p->type == T_regex) regcomp(&p->as.regex.regex, p->as.regex.arg, regex_flags());
+	}
+
+	while (1) {
+		size_t i = __atomic_fetch_add(&ps->next, 1, __ATOMIC_RELAXED);
+		if (i >= ps->regions_len) break;
+		search_region_matches(ps->regions + i, patterns, ps->text_end);
+	}
+
+	for_each(i, context->content_patterns_len) {
+		pattern *p = patterns + i;
+		if (p->type == T_regex) regfree(&p->as.regex.regex);
+	}
+	return 0;
+}
+
+char patterns_span_lines() {
+	// with -m regexes and wrapped patterns can match to the end of the file, each region would search it
+	if (!context->option_content_multiline) return 0;
+	for_each(i, context->content_patterns_len) {
+		if (!context->content_patterns[i].negated && term_cost(context->content_patterns + i)) return 1;
+	}
+	return 0;
+}
+
+void search_region_matches(search_region *region, pattern *patterns, char *text_end) {
+
+	// multiline literals can start in this region and end in the next one
+	char *match_end = context->option_content_multiline ? region->end + min(text_end - region->end, PATTERN_MAX_LEN) : region->end;
+
+	for_each(i, context->content_patterns_len) {
+		if (patterns[i].negated) continue;
+		pattern_rewind(patterns + i);
+		match_pattern(patterns + i, region->start, match_end);
+	}
+
+	char *cursor = region->start;
+	search_match found;
+	while (cursor < region->end && search_next(patterns, cursor, match_end, &found)) {
+		if (found.start >= region->end) break;
+		if (context->option_content_limit && region->found_len >= context->option_content_limit) break;
+
+		if (region->found_len == region->found_capacity) {
+			region->found_capacity = max(region->found_capacity * 2, 64);
+			search_match *grown = realloc(region->found, region->found_capacity * sizeof(search_match));
+			if (!grown) break;
+			region->found = grown;
+		}
+		region->found[region->found_len++] = found;
+
+		cursor = (char *)memchr_end(found.start + 1, '\n', region->end) + 1;
+	}
+
+	region->lines = count_lines(region->start, region->end);
+	if (region->end > region->start && region->end[-1] != '\n') region->lines += 1;
+}
+
+void count_match() {
+	if (result_capture.active) result_capture_record(R_count, 0, 0, 0, 0, 0, 0);
+	// only counted by the searching thread, the traversal thread of -P reads it for the limit
+	__atomic_store_n(&matches_count, matches_count + 1, __ATOMIC_RELAXED);
+	if (context->option_limit && matches_count == context->option_limit) loading_cancel();
+}
+
+void print_count(file_entry *file, size_t count) {
+	if (!count) return;
+	if (result_capture.active) result_capture_record(R_total, count, 0, 0, 0, 0, -1);
+	// counted up to the limit, as the matches would have been output, the cache keeps them all
+	if (context->option_limit) count = min(count, context->option_limit - min(matches_count, context->option_limit));
+	if (!count) return;
+
+	STATS_BEGIN(output_start)
+	if (result_callback) {
+		output_callback(MFG_RESULT_COUNT, file->path, count, 0, 0, 0, 0, -1);
+	} else {
+		printf_output("%s%s%s:%s%zu%s", COLOR_PATH, file->path, COLOR_SEP, COLOR_COL, count, COLOR_RESET);
+	}
+	STATS_END(output, output_start, 1, 0)
+
+	__atomic_store_n(&matches_count, matches_count + count, __ATOMIC_RELAXED);
+	if (context->option_limit && matches_count >= context->option_limit) loading_cancel();
+}
+
+void print_match(file_entry *file) {
+	if (result_capture.active) result_capture_record(R_path, 0, 0, 0, 0, 0, 0);
+	PROBE(match, file->path, 0, 0)
+	STATS_BEGIN(output_start)
+	if (result_callback) {
+		output_callback(MFG_RESULT_PATH, file->path, 0, 0, 0, 0, 0, -1);
+	} else {
+		printf_output("%s", file->path);
+	}
+	STATS_END(output, output_start, 1, 0)
+	count_match();
+}
+void print_match_path(string path) {
+	PROBE(match, path, 0, 0)
+	STATS_BEGIN(output_start)
+	if (result_callback) {
+		char display[PATH_MAX];
+		root_path(display, path);
+		output_callback(MFG_RESULT_PATH, display, 0, 0, 0, 0, 0, -1);
+	} else if (!roots_count) {
+		printf_output("%s", path);
+	} else {
+		const char *sep = roots[roots_index][strlen(roots[roots_index]) - 1] == '/' ? "" : "/";
+		printf_output("%s%s%s", roots[roots_index], sep, path);
+	}
+	STATS_END(output, output_start, 1, 0)
+	count_match();
+}
+
+void print_search_match(file_entry *file, filesize line, char *result_start, char *result_end, char *line_start, char *line_end, int pi) {
+
+	STATS_BEGIN(output_start)
+	int print_limit = DEFAULT_PRINT_LIMIT;
+	char line_pre[print_limit + 3], line_post[print_limit + 3];
+
+	if (result_end > line_end) result_end = line_end;
+	if (result_capture.active) result_capture_record(R_line, line, line_start, line_end, result_start, result_end, pi);
+	PROBE(match, file->path, line, result_end - result_start)
+	if (result_callback) {
+		output_callback(MFG_RESULT_LINE, file->path, line, line_start, line_end, result_start, result_end, pi);
+		STATS_END(output, output_start, 1, 0)
+		return;
+	}
+
+	int pattern_len = (result_end) - (result_start);
+	int line_pre_len = (result_start) - (line_start);
+	int line_post_len = (line_end) - (result_end);
+
+#define ELLIPSES "..."
+#define PRINT_OMITTED(TEMPLATE, ...)                     \
+	if (context->option_name_omit) {                              \
+		printf_output(TEMPLATE, ##__VA_ARGS__);          \
+	} else if (context->option_content_omit) {                    \
+		printf_output("%s%s%s:%s%ld%s",                  \
+					  COLOR_PATH, file->path, COLOR_SEP, \
+					  COLOR_COL, line, COLOR_RESET);     \
+	} else {                                             \
+		const char *sep = context->option_table ? "\t" : "";      \
+		printf_output("%s%s%s:%s%ld%s:%s" TEMPLATE,      \
+					  COLOR_PATH, file->path, COLOR_SEP, \
+					  COLOR_COL, line, COLOR_SEP,        \
+					  sep, ##__VA_ARGS__);               \
+	}
+
+	if (context->option_content_only) {
+		PRINT_OMITTED("%s%.*s%s",
+					  COLOR_MATCH(pi), pattern_len, result_start,
+					  COLOR_RESET)
+	} else if (context->option_plain || line_end - line_start < print_limit) {
+		memcpy(line_pre, line_start, line_pre_len);
+		memcpy(line_post, line_end - line_post_len, line_post_len);
+
+		PRINT_OMITTED("%s%.*s%s%.*s%s%.*s",
+					  COLOR_RESET, line_pre_len, line_pre,
+					  COLOR_MATCH(pi), pattern_len, result_start,
+					  COLOR_RESET, line_post_len, line_post)
+	} else if (result_end - line_start < print_limit) {
+		memcpy(line_pre, line_start, line_pre_len);
+		line_post_len = print_limit - (result_end - line_start);
+		memcpy(line_post, line_end - line_post_len, line_post_len);
+
+		PRINT_OMITTED("%s%.*s%s%.*s%s%.*s"
+					  "%s%s%s",
+					  COLOR_RESET, line_pre_len, line_pre,
+					  COLOR_MATCH(pi), pattern_len, result_start,
+					  COLOR_RESET, line_post_len, line_post,
+					  COLOR_DIM, ELLIPSES,
+					  COLOR_RESET);
+	} else {
+		int space_pre = (print_limit - pattern_len) / 2;
+		line_pre_len = min(line_pre_len, space_pre);
+		line_post_len = min(line_post_len, print_limit - pattern_len - line_pre_len);
+
+		memcpy(line_pre, result_start - line_pre_len, line_pre_len);
+		memcpy(line_post, result_end, line_post_len);
+
+		PRINT_OMITTED("%s%s%s"
+					  "%.*s%s%.*s%s%.*s"
+					  "%s%s%s",
+					  COLOR_DIM, ELLIPSES,
+					  COLOR_RESET, line_pre_len, line_pre,
+					  COLOR_MATCH(pi), pattern_len, result_start,
+					  COLOR_RESET, line_post_len, line_post,
+					  COLOR_DIM, ELLIPSES,
+					  COLOR_RESET);
+	}
+	STATS_END(output, output_start, 1, 0)
+}
+
+void print_search_match_around(file_entry *file, filesize line, char *line_start, char *line_end) {
+	if (result_callback) {
+		output_callback(MFG_RESULT_CONTEXT, file->path, line, line_start, line_end, line_start, line_start, -1);
+		return;
+	}
+	print_search_match(file, line, line_start, line_start, line_start, line_end, 0);
+}
+
+void output_callback(char kind, string path, filesize line, char *line_start, char *line_end, char *result_start, char *result_end, int pi) {
+	mfg_result result = {
+		.kind = kind,
+		.path = path,
+		.line = line,
+		.text = line_start,
+		.text_len = line_end - line_start,
+		.match_start = result_start - line_start,
+		.match_end = result_end - line_start,
+		.pattern = pi,
+	};
+	result_callback(&result, result_callback_data);
+}
+
+filesize dump_text(file_entry *file, filesize line, char *cursor, char *text_end) {
+
+	char *line_end;
+
+	while (cursor < text_end) {
+		line_end = memchr_end(cursor, '\n', text_end);
+
+		print_search_match_around(file, line, cursor, line_end);
+
+		cursor = line_end + 1;
+		line += 1;
+	}
+	return line;
+}
+
+void stream_search(file_entry *file, search_stream *stream, char *data, size_t len, char final) {
+	int around_lines = context->option_content_around * 2;
+
+	// keep only the lines before the cursor that can be printed as context
+	char *keep = lines_before(stream->start, stream->start + stream->cursor, around_lines);
+	size_t dropped = keep - stream->start;
+	if (dropped) {
+		memmove(stream->start, keep, stream->size - dropped);
+		stream->size -= dropped;
+		stream->cursor -= dropped;
+	}
+
+	if (stream->size + len + 1 > stream->capacity) {
+		size_t capacity = max(stream->capacity * 2, stream->size + len + 1);
+		char *start = realloc(stream->start, capacity);
+		if (!start) {
+			printf_error("Out of memory");
+			stream->state.done = 1;
+			return;
+		}
+		stream->start = start;
+		stream->capacity = capacity;
+	}
+	if (len) memcpy(stream->start + stream->size, data, len);
+	stream->size += len;
+
+	// search up to the last complete line, the rest waits for the next chunk
+	size_t end = stream->size;
+	if (!final) {
+		// the terms are decided on the whole content
+		if (context->content_terms_len) return;
+		char *last = memrchr(stream->start + stream->cursor, '\n', stream->size - stream->cursor);
+		if (!last) return;
+		end = last + 1 - stream->start;
+	}
+	if (end == stream->cursor) return;
+	if (context->content_terms_len && !search_terms(file, stream->start, stream->start + end)) {
+		stream->state.done = 1;
+		return;
+	}
+
+	search_text(file, stream->start, stream->start + stream->cursor, stream->start + end, &stream->state);
+	stream->cursor = end;
+}
+
+// === scheduling
+
+void schedule_file(string path, struct stat *st) {
+	scheduled_file *entry = schedule + schedule_len;
+	entry->path = strdup(path);
+	entry->st = *st;
+	entry->held = 0;
+	if (!entry->path) {
+		printf_error("Out of memory");
+		return;
+	}
+	schedule_len += 1;
+	if (schedule_len == SCHEDULE_WINDOW) schedule_flush();
+}
+
+scheduled_file *schedule_hold() {
+	// nothing waits in the window, the output is already in order
+	if (!schedule_len) return 0;
+
+	scheduled_file *entry = schedule + schedule_len;
+	entry->path = 0;
+	entry->held = 1;
+	entry->stream = open_memstream(&entry->output, &entry->output_len);
+	if (!entry->stream) return 0;
+	schedule_len += 1;
+	return entry;
+}
+
+void schedule_release(scheduled_file *entry) {
+	fflush(entry->stream);
+	if (!entry->output_len) {
+		// nothing was output, the slot is the last one
+		fclose(entry->stream);
+		free(entry->output);
+		schedule_len -= 1;
+		return;
+	}
+	if (schedule_len == SCHEDULE_WINDOW) schedule_flush();
+}
+
+void schedule_position(scheduled_file *entry) {
+	struct {
+		struct fiemap map;
+		struct fiemap_extent extents[1];
+	} request = {0};
+	request.map.fm_length = FIEMAP_MAX_OFFSET;
+	request.map.fm_extent_count = 1;
+
+	// where the first extent is on the device, inode numbers roughly follow the allocation otherwise
+	entry->mapped = !ioctl(entry->fd, FS_IOC_FIEMAP, &request) && request.map.fm_mapped_extents;
+	entry->position = entry->mapped ? request.extents[0].fe_physical : entry->st.st_ino;
+}
+
+int schedule_compare(const void *a, const void *b) {
+	const scheduled_file *x = *(scheduled_file **)a, *y = *(scheduled_file **)b;
+	if (x->st.st_dev != y->st.st_dev) return x->st.st_dev < y->st.st_dev ? -1 : 1;
+	if (x->mapped != y->mapped) return x->mapped - y->mapped;
+	if (x->position != y->position) return x->position < y->position ? -1 : 1;
+	return 0;
+}
+
+void schedule_flush() {
+	if (!schedule_len) return;
+
+	int sorted_len = 0;
+	for_each(i, schedule_len) {
+		scheduled_file *entry = schedule + i;
+		if (entry->held) continue;
+		schedule_sorted[sorted_len++] = entry;
+		entry->stream = 0;
+		entry->fd = content_open(entry->path, &entry->st, &entry->direct);
+		if (entry->fd >= 0) schedule_position(entry);
+	}
+	qsort(schedule_sorted, sorted_len, sizeof(scheduled_file *), schedule_compare);
+
+	for_each(i, sorted_len) {
+		scheduled_file *entry = schedule_sorted[i];
+		if (entry->fd < 0 || limit_reached()) {
+			if (entry->fd >= 0) close(entry->fd);
+			if (context->option_unique) inode_resolve(entry->st.st_dev, entry->st.st_ino, 0);
+			continue;
+		}
+		entry->stream = open_memstream(&entry->output, &entry->output_len);
+		file_entry *file = content_submit(entry->fd, entry->direct, S_resident, entry->path, &entry->st);
+		file->scheduled = entry->stream ? entry : 0;
+	}
+	loading_drain();
+
+	// the reorder buffer, output in the order the files were found
+	for_each(i, schedule_len) {
+		scheduled_file *entry = schedule + i;
+		if (entry->stream) {
+			fclose(entry->stream);
+			fwrite(entry->output, 1, entry->output_len, output);
+			free(entry->output);
+		}
+		free(entry->path);
+	}
+	schedule_len = 0;
+}
+
+// === decompression
+
+char check_compression(char *buffer, filesize len) {
+	unsigned char *bytes = (unsigned char *)buffer;
+#ifdef MFG_ZLIB
+	if (len >= 2 && bytes[0] == 0x1f && bytes[1] == 0x8b) return C_gzip;
+#endif
+#ifdef MFG_ZSTD
+	if (len >= 4 && bytes[0] == 0x28 && bytes[1] == 0xb5 && bytes[2] == 0x2f && bytes[3] == 0xfd) return C_zstd;
+#endif
+	return 0;
+}
+
+int decompress_init(decompressor *d) {
+
+	pthread_mutex_init(&d->lock, 0);
+	pthread_cond_init(&d->cond, 0);
+
+	for_each(i, DECOMPRESS_CHUNKS) {
+		d->chunks[i] = malloc(DECOMPRESS_CHUNK_SIZE);
+		if (!d->chunks[i]) {
+			printf_error("Out of memory");
+			return 1;
+		}
+	}
+#ifdef MFG_ZLIB
+	if (d->format == C_gzip) {
+		d->gzip.next_in = (Bytef *)d->input;
+		d->gzip.avail_in = d->input_len;
+		if (inflateInit2(&d->gzip, 15 + 32) != Z_OK) return 1;
+	}
+#endif
+#ifdef MFG_ZSTD
+	if (d->format == C_zstd) {
+		d->zstd = ZSTD_createDStream();
+		if (!d->zstd || ZSTD_isError(ZSTD_initDStream(d->zstd))) return 1;
+		d->zstd_input = (ZSTD_inBuffer){d->input, d->input_len, 0};
+	}
+#endif
+
+	d->threaded = !pthread_create(&d->thread, 0, decompress_worker, d);
+	return 0;
+}
+
+void decompress_free(decompressor *d) {
+	if (d->threaded) {
+		pthread_mutex_lock(&d->lock);
+		d->stop = 1;
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+		pthread_join(d->thread, 0);
+	}
+	pthread_mutex_destroy(&d->lock);
+	pthread_cond_destroy(&d->cond);
+
+	for_each(i, DECOMPRESS_CHUNKS) {
+		free(d->chunks[i]);
+	}
+#ifdef MFG_ZLIB
+	if (d->format == C_gzip) inflateEnd(&d->gzip);
+#endif
+#ifdef MFG_ZSTD
+	if (d->format == C_zstd) ZSTD_freeDStream(d->zstd);
+#endif
+}
+
+char decompress_chunk(decompressor *d, size_t slot) {
+	char *out = d->chunks[slot];
+	char end = 1;
+	d->chunk_sizes[slot] = 0;
+
+#ifdef MFG_ZLIB
+	if (d->format == C_gzip) {
+		z_stream *zs = &d->gzip;
+		zs->next_out = (Bytef *)out;
+		zs->avail_out = DECOMPRESS_CHUNK_SIZE;
+		end = 0;
+		while (zs->avail_out && !end) {
+			int ret = inflate(zs, Z_NO_FLUSH);
+			if (ret == Z_STREAM_END) {
+				// concatenated members continue the same stream
+				if (zs->avail_in) {
+					inflateReset(zs);
+				} else {
+					end = 1;
+				}
+			} else if (ret != Z_OK) {
+				d->failed = 1;
+				end = 1;
+			}
+		}
+		d->chunk_sizes[slot] = DECOMPRESS_CHUNK_SIZE - zs->avail_out;
+	}
+#endif
+#ifdef MFG_ZSTD
+	if (d->format == C_zstd) {
+		ZSTD_outBuffer output = {out, DECOMPRESS_CHUNK_SIZE, 0};
+		end = 0;
+		while (output.pos < output.size && !end) {
+			size_t ret = ZSTD_decompressStream(d->zstd, &output, &d->zstd_input);
+			if (ZSTD_isError(ret)) {
+				d->failed = 1;
+				end = 1;
+			} else if (d->zstd_input.pos == d->zstd_input.size && output.pos < output.size) {
+				// all input consumed and flushed, a frame left open means truncated input
+				if (ret) d->failed = 1;
+				end = 1;
+			}
+		}
+		d->chunk_sizes[slot] = output.pos;
+	}
+#endif
+	return end;
+}
+
+void *decompress_worker(void *arg) {
+	decompressor *d = arg;
+
+	pthread_mutex_lock(&d->lock);
+	while (!d->finished && !d->stop) {
+		if (d->produced - d->consumed == DECOMPRESS_CHUNKS) {
+			pthread_cond_wait(&d->cond, &d->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&d->lock);
+		char end = decompress_chunk(d, d->produced % DECOMPRESS_CHUNKS);
+		pthread_mutex_lock(&d->lock);
+
+		d->produced += 1;
+		d->finished = end;
+		pthread_cond_broadcast(&d->cond);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+char *decompress_take(decompressor *d, size_t *len) {
+	if (!d->threaded) {
+		if (d->finished) return 0;
+		d->finished = decompress_chunk(d, 0);
+		*len = d->chunk_sizes[0];
+		return d->chunks[0];
+	}
+
+	pthread_mutex_lock(&d->lock);
+	while (d->produced == d->consumed && !d->finished) {
+		pthread_cond_wait(&d->cond, &d->lock);
+	}
+	char *chunk = 0;
+	if (d->produced != d->consumed) {
+		chunk = d->chunks[d->consumed % DECOMPRESS_CHUNKS];
+		*len = d->chunk_sizes[d->consumed % DECOMPRESS_CHUNKS];
+	}
+	pthread_mutex_unlock(&d->lock);
+	return chunk;
+}
+
+void decompress_release(decompressor *d) {
+	if (!d->threaded) return;
+
+	pthread_mutex_lock(&d->lock);
+	d->consumed += 1;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+}
+
+void handle_decompress(file_entry *file) {
+
+	decompressor d = {
+		.format = file->compression,
+		.input = file->buffer.start,
+		.input_len = file->buffer.size,
+	};
+	search_stream stream = {.state = {.line = 1, .stream = 1}};
+
+	if (!decompress_init(&d)) {
+		char first = 1;
+		size_t len;
+		char *chunk;
+		while ((chunk = decompress_take(&d, &len))) {
+			if (first) {
+				first = 0;
+				if (check_binary(chunk, len)) {
+					if (context->option_file_type == 'b') print_match(file);
+					stream.state.done = 1;
+				} else if (!context->content_patterns_len) {
+					if (context->option_file_type == 't') print_match(file);
+					stream.state.done = 1;
+				}
+			}
+			if (!stream.state.done) stream_search(file, &stream, chunk, len, 0);
+			decompress_release(&d);
+			if (stream.state.done) break;
+		}
+		if (!stream.state.done) stream_search(file, &stream, 0, 0, 1);
+		if (context->option_count) print_count(file, stream.state.matches);
+	} else {
+		d.failed = 1;
+	}
+	decompress_free(&d);
+	free(stream.start);
+
+	if (d.failed) {
+		errors_count += 1;
+		printf_error_verbose("Failed to decompress '%s'", file->path);
+	}
+}
+
+// === input
+
+int input_search() {
+
+	// a larger pipe lets the producer run ahead while a chunk is searched
+	fcntl(STDIN_FILENO, F_SETPIPE_SZ, INPUT_PIPE_SIZE);
+
+	char *chunk = malloc(INPUT_CHUNK_SIZE);
+	if (!chunk) {
+		printf_error("Out of memory");
+		return 1;
+	}
+	file_entry *file = &input_file_entry;
+	strcpy(file->path, "-");
+	search_stream stream = {.state = {.line = 1, .stream = 1}};
+
+	char first = 1;
+	ssize_t len = 0;
+	while (!stream.state.done && !limit_reached()) {
+		// returns what the producer wrote so far, lines are output as soon as they are complete
+		STATS_BEGIN(read_start)
+		len = read(STDIN_FILENO, chunk, INPUT_CHUNK_SIZE);
+		if (len < 0 && errno == EINTR) continue;
+		if (len <= 0) break;
+		STATS_END(read, read_start, 1, len)
+
+		if (first) {
+			first = 0;
+			if (check_binary(chunk, len)) {
+				if (context->option_file_type == 'b') print_match(file);
+				break;
+			} else if (!context->content_patterns_len) {
+				if (context->option_file_type == 't') print_match(file);
+				break;
+			}
+		}
+		stream_search(file, &stream, chunk, len, 0);
+		fflush(output);
+	}
+	if (len < 0) {
+		errors_count += 1;
+		printf_error_verbose("Error reading the input");
+	}
+	if (!first && !stream.state.done && !limit_reached()) stream_search(file, &stream, 0, 0, 1);
+	if (context->option_count) print_count(file, stream.state.matches);
+	fflush(output);
+
+	free(stream.start);
+	free(chunk);
+	return 0;
+}
+
+// === inodes
+
+inode_entry *inode_find(dev_t dev, ino_t ino) {
+
+	if (inodes_count * 2 >= inodes_capacity) {
+		size_t old_capacity = inodes_capacity;
+		inode_entry *old = inodes;
+
+		inodes_capacity = max(old_capacity * 2, 1024);
+		inodes = calloc(inodes_capacity, sizeof(inode_entry));
+		if (!inodes) {
+			printf_error("Out of memory");
+			exit(ERROR_INTERNAL);
+		}
+		for_each(i, old_capacity) {
+			if (old[i].state == I_empty) continue;
+			*inode_find(old[i].dev, old[i].ino) = old[i];
+		}
+		free(old);
+	}
+
+	unsigned long long hash = (unsigned long long)ino * 0x9e3779b97f4a7c15ull ^ (unsigned long long)dev;
+	hash ^= hash >> 29;
+	for (size_t i = hash & (inodes_capacity - 1);; i = (i + 1) & (inodes_capacity - 1)) {
+		inode_entry *entry = inodes + i;
+		if (entry->state == I_empty || (entry->dev == dev && entry->ino == ino)) return entry;
+	}
+}
+
+char inode_visit_directory(struct stat *st) {
+	inode_entry *entry = inode_find(st->st_dev, st->st_ino);
+	if (entry->state != I_empty) return 0;
+
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->state = I_directory;
+	inodes_count += 1;
+	return 1;
+}
+
+char inode_visit_file(string path, struct stat *st) {
+	inode_entry *entry = inode_find(st->st_dev, st->st_ino);
+
+	if (entry->state == I_empty || entry->state == I_changed) {
+		if (entry->state == I_empty) inodes_count += 1;
+		entry->dev = st->st_dev;
+		entry->ino = st->st_ino;
+		entry->state = I_pending;
+		return 1;
+	}
+	if (context->option_unique < 2) return 0;
+
+	// report the other paths of the file from its result
+	if (entry->state == I_matched) {
+		print_match_path(path);
+	} else if (entry->state == I_pending) {
+		inode_alias *alias = malloc(sizeof(inode_alias) + PATH_MAX);
+		if (!alias) return 0;
+		root_path(alias->path, path);
+		alias->next = entry->aliases;
+		entry->aliases = alias;
+	}
+	return 0;
+}
+
+void inode_forget_file(struct stat *st) {
+	// searched again when it changes, or when a new file reuses the inode, the entry stays for the probing
+	inode_entry *entry = inode_find(st->st_dev, st->st_ino);
+	if (entry->state == I_matched || entry->state == I_unmatched) entry->state = I_changed;
+}
+
+void inode_resolve(dev_t dev, ino_t ino, char matched) {
+	inode_entry *entry = inode_find(dev, ino);
+	if (entry->state != I_pending) return;
+	entry->state = matched ? I_matched : I_unmatched;
+
+	while (entry->aliases) {
+		inode_alias *alias = entry->aliases;
+		entry->aliases = alias->next;
+		if (matched && !limit_reached()) {
+			if (result_callback) {
+				output_callback(MFG_RESULT_PATH, alias->path, 0, 0, 0, 0, 0, -1);
+			} else {
+				printf_output("%s", alias->path);
+			}
+			count_match();
+		}
+		free(alias);
+	}
+}
+
+// === result cache
+
+unsigned long long hash_bytes(unsigned long long hash, const void *data, size_t len) {
+	const unsigned char *bytes = data;
+	for_each(i, len) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+unsigned long long result_cache_hash() {
+
+	// everything that changes which lines of a file are output, the formatting is applied when replaying
+	char options[] = {
+		context->option_file_type, context->option_query, context->option_decompress,
+		context->option_content_case, context->option_content_multiline, context->option_content_around, context->option_content_all, //
+		context->option_count, context->option_count && context->option_content_only,										   //
+	};
+	unsigned long long hash = hash_bytes(0xcbf29ce484222325ull, RESULT_CACHE_MAGIC, sizeof(RESULT_CACHE_MAGIC));
+	hash = hash_bytes(hash, options, sizeof(options));
+	hash = hash_bytes(hash, &context->option_content_limit, sizeof(context->option_content_limit));
+
+	for_each(i, context->content_patterns_len) {
+		pattern *p = context->content_patterns + i;
+		string args[2] = {0};
+		switch (p->type) {
+		case T_any:
+		case T_start:
+		case T_end:
+			args[0] = p->as.any.arg;
+			break;
+		case T_wrap:
+			args[0] = p->as.wrap.start.arg;
+			args[1] = p->as.wrap.end.arg;
+			break;
+		case T_regex:
+			args[0] = p->as.regex.arg;
+			break;
+		}
+		hash = hash_bytes(hash, &p->type, 1);
+		hash = hash_bytes(hash, &p->negated, 1);
+		for_each(a, 2) {
+			if (args[a]) hash = hash_bytes(hash, args[a], strlen(args[a]) + 1);
+		}
+	}
+	return hash;
+}
+
+int cache_directory(char *dir, size_t size) {
+
+	string base = getenv("XDG_CACHE_HOME");
+	string home = getenv("HOME");
+	if (base && base[0]) {
+		snprintf(dir, size, "%s/mfg", base);
+	} else if (home && home[0]) {
+		snprintf(dir, size, "%s/.cache/mfg", home);
+	} else {
+		printf_error("No cache directory, set XDG_CACHE_HOME or HOME");
+		return 1;
+	}
+	for (char *c = dir + 1; *c; c++) {
+		if (*c != '/') continue;
+		*c = 0;
+		mkdir(dir, 0700);
+		*c = '/';
+	}
+	if (mkdir(dir, 0700) && errno != EEXIST) {
+		printf_error("Could not create the cache directory '%s'", dir);
+		return 1;
+	}
+	return 0;
+}
+
+int result_cache_open() {
+
+	char dir[PATH_MAX];
+	if (cache_directory(dir, sizeof(dir))) return 1;
+
+	result_cache_query = result_cache_hash();
+	if (snprintf(result_cache_path, sizeof(result_cache_path), "%s/%016llx", dir, result_cache_query) >= sizeof(result_cache_path)) {
+		printf_error("Cache directory path too long '%s'", dir);
+		return 1;
+	}
+
+	int fd = open(result_cache_path, O_RDONLY);
+	if (fd < 0) return 0; // first run of this query
+	struct stat st;
+	if (!fstat(fd, &st) && st.st_size >= sizeof(result_cache_header)) {
+		void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			result_cache_map = map;
+			result_cache_map_size = st.st_size;
+		}
+	}
+	close(fd);
+	if (!result_cache_map) return 0;
+
+	result_cache_header header;
+	memcpy(&header, result_cache_map, sizeof(header));
+	size_t index_size = header.count * sizeof(result_cache_entry);
+	if (memcmp(header.magic, RESULT_CACHE_MAGIC, sizeof(header.magic)) ||
+		header.query != result_cache_query ||
+		header.count > result_cache_map_size / sizeof(result_cache_entry) ||
+		sizeof(header) + index_size > result_cache_map_size) {
+		printf_error_verbose("Ignoring invalid result cache '%s'", result_cache_path);
+		return 0;
+	}
+	result_cache_old = (result_cache_entry *)(result_cache_map + sizeof(header));
+	result_cache_old_count = header.count;
+	result_cache_old_data = result_cache_map + sizeof(header) + index_size;
+	result_cache_old_data_size = result_cache_map_size - sizeof(header) - index_size;
+
+	result_cache_old_state = calloc(header.count + 1, 1);
+	if (!result_cache_old_state) {
+		printf_error("Out of memory");
+		return 1;
+	}
+	return 0;
+}
+
+int result_cache_compare(const void *a, const void *b) {
+	const result_cache_entry *x = a, *y = b;
+	if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+	if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+	return 0;
+}
+
+int result_cache_replay(string path, struct stat *st) {
+
+	result_cache_entry key = {.dev = st->st_dev, .ino = st->st_ino};
+	result_cache_entry *entry = bsearch(&key, result_cache_old, result_cache_old_count,
+										sizeof(result_cache_entry), result_cache_compare);
+	if (!entry) return -1;
+	// a changed file is searched again, its entry is dropped even when the new results are not kept
+	char *state = result_cache_old_state + (entry - result_cache_old);
+	if (entry->size != st->st_size || entry->mtime != stat_mtime_ns(st) ||
+		entry->offset > result_cache_old_data_size || entry->length > result_cache_old_data_size - entry->offset) {
+		*state = C_stale;
+		return -1;
+	}
+	*state = C_replayed;
+
+	if (context->option_stats) stats.result_cache_hits += 1;
+	file_entry *file = &result_cache_file;
+	root_path(file->path, path);
+
+	// the unchanged file is answered with the recorded output calls, without opening it
+	char matched = 0;
+	char *cursor = result_cache_old_data + entry->offset;
+	char *end = cursor + entry->length;
+	while (cursor + sizeof(result_record) <= end && !limit_reached()) {
+		result_record record;
+		memcpy(&record, cursor, sizeof(record));
+		char *line_start = cursor + sizeof(record);
+		if (record.line_len > end - line_start || record.result_start + record.result_len > record.line_len) break;
+
+		switch (record.kind) {
+		case R_line:
+			print_search_match(file, record.line,
+							   line_start + record.result_start,
+							   line_start + record.result_start + record.result_len,
+							   line_start, line_start + record.line_len, record.pattern);
+			break;
+		case R_path:
+			STATS_BEGIN(output_start)
+			printf_output("%s", file->path);
+			STATS_END(output, output_start, 1, 0)
+			break;
+		case R_count:
+			count_match();
+			matched = 1;
+			break;
+		case R_total:
+			print_count(file, record.line);
+			matched = 1;
+			break;
+		}
+		cursor += (sizeof(record) + record.line_len + 7) / 8 * 8;
+	}
+	return matched;
+}
+
+void result_capture_begin() {
+	result_capture.active = 1;
+	result_capture.errors = errors_count;
+	result_capture.start = result_cache_data_size;
+}
+
+void result_capture_record(char kind, filesize line, char *line_start, char *line_end, char *result_start, char *result_end, int pi) {
+
+	size_t line_len = line_end - line_start;
+	size_t size = (sizeof(result_record) + line_len + 7) / 8 * 8;
+
+	if (result_cache_data_size + size > result_cache_data_capacity) {
+		size_t capacity = max(max(result_cache_data_capacity * 2, 64 * 1024), result_cache_data_size + size);
+		char *grown = realloc(result_cache_data, capacity);
+		if (grown) {
+			result_cache_data = grown;
+			result_cache_data_capacity = capacity;
+		}
+	}
+	if (result_cache_data_size + size > result_cache_data_capacity ||
+		result_cache_data_size + size - result_capture.start > RESULT_CACHE_ENTRY_LIMIT) {
+		// too much output to keep, the file is searched again next time
+		result_cache_data_size = result_capture.start;
+		result_capture.active = 0;
+		return;
+	}
+
+	result_record record = {
+		.kind = kind,
+		.pattern = pi,
+		.line = line,
+		.line_len = line_len,
+		.result_start = result_start - line_start,
+		.result_len = result_end - result_start,
+	};
+	char *target = result_cache_data + result_cache_data_size;
+	memset(target, 0, size);
+	memcpy(target, &record, sizeof(record));
+	if (line_len) memcpy(target + sizeof(record), line_start, line_len);
+	result_cache_data_size += size;
+}
+
+void result_cache_store(file_entry *file) {
+	if (!result_capture.active) return;
+	result_capture.active = 0;
+
+	// errors and the match limit leave partial results
+	if (errors_count != result_capture.errors || limit_reached()) {
+		result_cache_data_size = result_capture.start;
+		return;
+	}
+
+	if (result_cache_new_count == result_cache_new_capacity) {
+		size_t capacity = max(result_cache_new_capacity * 2, 1024);
+		result_cache_entry *grown = realloc(result_cache_new, capacity * sizeof(result_cache_entry));
+		if (!grown) {
+			result_cache_data_size = result_capture.start;
+			return;
+		}
+		result_cache_new = grown;
+		result_cache_new_capacity = capacity;
+	}
+	result_cache_entry entry = {
+		.dev = file->dev,
+		.ino = file->ino,
+		.size = file->size,
+		.mtime = file->mtime,
+		.offset = result_capture.start,
+		.length = result_cache_data_size - result_capture.start,
+		.used = time(0),
+	};
+	result_cache_new[result_cache_new_count++] = entry;
+}
+
+void result_cache_save() {
+
+	// entries of deleted, replaced or changed files are never replayed, they are dropped when stale or not
+	// used for a while, the times of the replayed ones are refreshed daily to not rewrite the cache each run
+	time_t now = time(0);
+	char changed = result_cache_new_count != 0;
+	for_each(i, result_cache_old_count) {
+		if (changed) break;
+		time_t age = now - result_cache_old[i].used;
+		char state = result_cache_old_state[i];
+		changed = state == C_stale || age > RESULT_CACHE_MAX_AGE || (state == C_replayed && age > 24 * 3600);
+	}
+	if (!changed) return;
+
+	qsort(result_cache_new, result_cache_new_count, sizeof(result_cache_entry), result_cache_compare);
+
+	// merge with the entries of files that were not searched again, the new ones win
+	size_t capacity = result_cache_old_count + result_cache_new_count;
+	result_cache_entry *merged = malloc(capacity * sizeof(result_cache_entry));
+	char **sources = malloc(capacity * sizeof(char *));
+	if (!merged || !sources) {
+		printf_error("Out of memory");
+		free(merged);
+		free(sources);
+		return;
+	}
+
+	size_t count = 0, offset = 0;
+	size_t old_i = 0, new_i = 0;
+	while (old_i < result_cache_old_count || new_i < result_cache_new_count) {
+		result_cache_entry *entry;
+		char *source;
+		int order = old_i == result_cache_old_count   ? 1
+					: new_i == result_cache_new_count ? -1
+													  : result_cache_compare(result_cache_old + old_i, result_cache_new + new_i);
+		char replayed = 0;
+		if (order < 0) {
+			char state = result_cache_old_state[old_i];
+			entry = result_cache_old + old_i++;
+			if (entry->offset > result_cache_old_data_size || entry->length > result_cache_old_data_size - entry->offset) continue;
+			if (state == C_stale || (state != C_replayed && now - entry->used > RESULT_CACHE_MAX_AGE)) continue;
+			replayed = state == C_replayed;
+			source = result_cache_old_data + entry->offset;
+		} else {
+			if (order == 0) old_i += 1;
+			entry = result_cache_new + new_i++;
+			source = result_cache_data + entry->offset;
+		}
+		// hardlinks searched through several paths have the same results
+		if (count && !result_cache_compare(merged + count - 1, entry)) continue;
+
+		merged[count] = *entry;
+		merged[count].offset = offset;
+		if (replayed) merged[count].used = now;
+		sources[count] = source;
+		offset += entry->length;
+		count += 1;
+	}
+
+	char temp_path[PATH_MAX + 16];
+	snprintf(temp_path, sizeof(temp_path), "%s.%d", result_cache_path, getpid());
+	FILE *out = fopen(temp_path, "w");
+	char failed = !out;
+	if (out) {
+		result_cache_header header = {.query = result_cache_query, .count = count};
+		memcpy(header.magic, RESULT_CACHE_MAGIC, sizeof(header.magic));
+		failed |= fwrite(&header, sizeof(header), 1, out) != 1;
+		failed |= fwrite(merged, sizeof(result_cache_entry), count, out) != count;
+		for_each(i, count) {
+			if (failed) break;
+			failed |= fwrite(sources[i], 1, merged[i].length, out) != merged[i].length;
+		}
+		failed |= fclose(out) != 0;
+	}
+	// replaced atomically, concurrent runs keep reading their own mapping
+	if (failed || rename(temp_path, result_cache_path)) {
+		printf_error("Could not write the result cache '%s'", result_cache_path);
+		unlink(temp_path);
+	}
+
+	free(merged);
+	free(sources);
+}
+
+void result_cache_release() {
+	free(result_cache_new);
+	free(result_cache_data);
+	free(result_cache_old_state);
+	if (result_cache_map) munmap(result_cache_map, result_cache_map_size);
+	result_cache_new = 0;
+	result_cache_new_count = result_cache_new_capacity = 0;
+	result_cache_data = 0;
+	result_cache_data_size = result_cache_data_capacity = 0;
+	result_cache_old_state = 0;
+	result_cache_old = 0;
+	result_cache_old_count = 0;
+	result_cache_map = 0;
+	result_cache_map_size = 0;
+	result_capture.active = 0;
+}
+
+// === classes
+
+// extensions only used by binary formats, the binary check rejects them after a read,
+// the ones shared with text formats (obj, pdb, db, img, idx) are left to the check
+string binary_extensions[] = {
+	"a", "o", "so", "ko", "dll", "exe", "dylib", "class", "jar", "war", "pyc", "pyo", "wasm",
+	"png", "jpg", "jpeg", "gif", "bmp", "ico", "webp", "tif", "tiff", "psd",
+	"mp3", "mp4", "m4a", "ogg", "flac", "wav", "avi", "mkv", "mov", "webm",
+	"zip", "7z", "rar", "xz", "bz2", "lz4", "tar", "deb", "rpm", "iso",
+	"pdf", "woff", "woff2", "ttf", "otf", "eot", "sqlite",
+	0,
+};
+
+// binary names without an extension
+string binary_names[] = {
+	"core", ".DS_Store", 0,
+};
+
+// searchable with -z, the decompression decides
+string compressed_extensions[] = {
+	"gz", "tgz", "zst", 0,
+};
+
+void init_classes() {
+	if (classes_ready) return;
+	classes_ready = 1;
+
+	// set but empty turns the built-in table off
+	string user = getenv("MFG_BINARY");
+	if (user && !user[0]) return;
+	classes_builtin = 1;
+
+	for (string *e = binary_extensions; *e; e++) {
+		class_entry *entry = class_find(*e, 1);
+		if (entry) entry->known = 1;
+	}
+	for (string *e = compressed_extensions; *e; e++) {
+		class_entry *entry = class_find(*e, 1);
+		if (entry) entry->known = 'z';
+	}
+
+	// user changes, comma separated extensions, added or with a - removed
+	if (!user) return;
+	char extension[CLASS_EXTENSION_LEN];
+	while (*user) {
+		size_t len = strcspn(user, ",");
+		char removed = user[0] == '-';
+		string start = user + removed;
+		if (start[0] == '.') start += 1;
+		size_t start_len = len - (start - user);
+		if (start_len && start_len < CLASS_EXTENSION_LEN) {
+			for_each(i, start_len) {
+				extension[i] = tolower((unsigned char)start[i]);
+			}
+			extension[start_len] = 0;
+			class_entry *entry = class_find(extension, !removed);
+			if (entry) entry->known = !removed;
+		}
+		user += len + (user[len] == ',');
+	}
+}
+
+int class_extension(string name, char *extension) {
+	string dot = strrchr(name, '.');
+	if (!dot || dot == name || !dot[1]) return 0;
+	size_t len = strlen(dot + 1);
+	if (len >= CLASS_EXTENSION_LEN) return 0;
+	for_each(i, len + 1) {
+		extension[i] = tolower((unsigned char)dot[1 + i]);
+	}
+	return 1;
+}
+
+class_entry *class_find(string extension, char add) {
+	unsigned long long hash = hash_bytes(0xcbf29ce484222325ull, extension, strlen(extension));
+	for_each(probe, CLASS_TABLE_SIZE) {
+		class_entry *entry = classes + (hash + probe) % CLASS_TABLE_SIZE;
+		if (str_equals(entry->extension, extension)) return entry;
+		if (entry->extension[0]) continue;
+		// kept sparse, the extensions of a tree are few
+		if (!add || classes_count >= CLASS_TABLE_SIZE / 2) return 0;
+		strcpy(entry->extension, extension);
+		classes_count += 1;
+		return entry;
+	}
+	return 0;
+}
+
+char class_binary(string name) {
+	for (string *n = binary_names; classes_builtin && *n; n++) {
+		if (str_equals(name, *n)) return 1;
+	}
+	char extension[CLASS_EXTENSION_LEN];
+	if (!class_extension(name, extension)) return 0;
+	class_entry *entry = class_find(extension, 0);
+	if (!entry) return 0;
+	if (entry->known == 'z') return !context->option_decompress;
+	if (entry->known) return 1;
+	// learned, only while every file of the extension was binary, a sample is still read so a text one is found
+	if (!context->option_learn || entry->binary < CLASS_LEARN_MIN || entry->text) return 0;
+	return ++entry->skipped % CLASS_LEARN_SAMPLE != 0;
+}
+
+void class_learn(string path, char binary) {
+	string slash = strrchr(path, '/');
+	char extension[CLASS_EXTENSION_LEN];
+	if (!class_extension(slash ? slash + 1 : path, extension)) return;
+	class_entry *entry = class_find(extension, 1);
+	if (!entry || entry->known) return;
+	if (binary) {
+		entry->binary += 1;
+	} else {
+		entry->text += 1;
+	}
+	classes_learned = 1;
+}
+
+int classes_open() {
+
+	char dir[PATH_MAX];
+	if (cache_directory(dir, sizeof(dir))) return 1;
+
+	// a table for each tree, the same roots give the same tree
+	unsigned long long tree = hash_bytes(0xcbf29ce484222325ull, "mfgcls1", 8);
+	for_each(i, max(roots_count, 1)) {
+		char root[PATH_MAX];
+		if (!realpath(roots_count ? roots[i] : ".", root)) continue;
+		tree = hash_bytes(tree, root, strlen(root) + 1);
+	}
+	if (snprintf(classes_path, sizeof(classes_path), "%s/classes-%016llx", dir, tree) >= sizeof(classes_path)) {
+		printf_error("Cache directory path too long '%s'", dir);
+		return 1;
+	}
+
+	FILE *in = fopen(classes_path, "r");
+	if (!in) return 0; // first run in this tree
+	char extension[CLASS_EXTENSION_LEN];
+	unsigned int binary, text;
+	while (fscanf(in, "%15s %u %u", extension, &binary, &text) == 3) {
+		class_entry *entry = class_find(extension, 1);
+		if (!entry || entry->known) continue;
+		entry->binary = binary;
+		entry->text = text;
+	}
+	fclose(in);
+	return 0;
+}
+
+void classes_save() {
+	if (!classes_learned) return;
+
+	char temp_path[PATH_MAX + 16];
+	snprintf(temp_path, sizeof(temp_path), "%s.%d", classes_path, getpid());
+	FILE *out = fopen(temp_path, "w");
+	char failed = !out;
+	if (out) {
+		for_each(i, CLASS_TABLE_SIZE) {
+			class_entry *entry = classes + i;
+			if (!entry->extension[0] || entry->known || (!entry->binary && !entry->text)) continue;
+			failed |= fprintf(out, "%s %u %u\n", entry->extension, entry->binary, entry->text) < 0;
+		}
+		failed |= fclose(out) != 0;
+	}
+	if (failed || rename(temp_path, classes_path)) {
+		printf_error("Could not write the learned classes '%s'", classes_path);
+		unlink(temp_path);
+	}
+}
+
+// === watch
+
+int watch_init() {
+	watch_fd = inotify_init1(IN_CLOEXEC);
+	watch_roots = calloc(max(roots_count, 1), sizeof(int));
+	if (watch_fd < 0 || !watch_roots) {
+		printf_error("Could not start watching");
+		return 1;
+	}
+	return 0;
+}
+
+void watch_add_root() {
+	// the events are handled from the directory of their root, kept after the next root is opened
+	watch_roots[roots_index] = root_fd == AT_FDCWD ? AT_FDCWD : fcntl(root_fd, F_DUPFD_CLOEXEC, 0);
+}
+
+void watch_add_directory(string path) {
+
+	if (path_dot(path)) path = "";
+	if (path[0] == '.' && path[1] == '/') path += 2;
+
+	char resolved[PATH_MAX + 32];
+	int wd = inotify_add_watch(watch_fd, root_resolve(resolved, path[0] ? path : "."), WATCH_EVENTS);
+	if (wd < 0) {
+		errors_count += 1;
+		printf_error_verbose("Could not watch '%s'", path);
+		return;
+	}
+	if (wd >= watch_dirs_capacity) {
+		int capacity = max(watch_dirs_capacity * 2, wd + 1024);
+		watch_dir *grown = realloc(watch_dirs, capacity * sizeof(watch_dir));
+		if (!grown) {
+			printf_error("Out of memory");
+			return;
+		}
+		memset(grown + watch_dirs_capacity, 0, (capacity - watch_dirs_capacity) * sizeof(watch_dir));
+		watch_dirs = grown;
+		watch_dirs_capacity = capacity;
+	}
+	watch_dir *dir = watch_dirs + wd;
+	free(dir->path);
+	dir->root = roots_index;
+	dir->path = strdup(path);
+}
+
+watch_file *watch_find(string path) {
+
+	if (watch_files_count * 2 >= watch_files_capacity) {
+		size_t old_capacity = watch_files_capacity;
+		watch_file *old = watch_files;
+
+		watch_files_capacity = max(old_capacity * 2, 1024);
+		watch_files = calloc(watch_files_capacity, sizeof(watch_file));
+		if (!watch_files) {
+			printf_error("Out of memory");
+			exit(ERROR_INTERNAL);
+		}
+		for_each(i, old_capacity) {
+			if (!old[i].path) continue;
+			size_t j = watch_hash(old[i].path, old[i].root) & (watch_files_capacity - 1);
+			while (watch_files[j].path) j = (j + 1) & (watch_files_capacity - 1);
+			watch_files[j] = old[i];
+		}
+		free(old);
+	}
+
+	size_t i = watch_hash(path, roots_index) & (watch_files_capacity - 1);
+	while (watch_files[i].path) {
+		if (watch_files[i].root == roots_index && str_equals(watch_files[i].path, path)) return watch_files + i;
+		i = (i + 1) & (watch_files_capacity - 1);
+	}
+	watch_files_count += 1;
+	watch_files[i].path = strdup(path);
+	watch_files[i].root = roots_index;
+	return watch_files + i;
+}
+
+unsigned long long watch_hash(string path, int root) {
+	unsigned long long hash = hash_bytes(0xcbf29ce484222325ull, path, strlen(path));
+	return hash_bytes(hash, &root, sizeof(root));
+}
+
+void watch_track_file(string path, struct stat *st) {
+	watch_file *tracked = watch_find(path);
+	tracked->present = 1;
+	tracked->ino = st->st_ino;
+	tracked->size = st->st_size;
+	tracked->offset = -1;
+	tracked->lines = 0;
+}
+
+int watch_run() {
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX];
+
+	// each event is resolved from its own root, watch_add_root kept them open
+	root_close();
+	while (!limit_reached()) {
+		fflush(stdout);
+		ssize_t len = read(watch_fd, buffer, sizeof(buffer));
+		if (len < 0 && errno == EINTR) continue;
+		if (len <= 0) {
+			printf_error("Could not read the watched events");
+			return 1;
+		}
+		if (context->metadata_files || context->metadata_directories) metadata_refresh();
+
+		for (char *cursor = buffer; cursor < buffer + len && !limit_reached();) {
+			struct inotify_event *event = (struct inotify_event *)cursor;
+			cursor += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				errors_count += 1;
+				printf_error_verbose("Too many changes, some were not searched");
+				continue;
+			}
+			if (event->wd < 0 || event->wd >= watch_dirs_capacity || !watch_dirs[event->wd].path) continue;
+			watch_dir *dir = watch_dirs + event->wd;
+			if (event->mask & IN_IGNORED) {
+				free(dir->path);
+				dir->path = 0;
+				continue;
+			}
+			if (!event->len) continue;
+
+			string name = event->name;
+			if (path_dot(name) || path_ddot(name)) continue;
+			if (context->option_unhidden && path_hidden(name)) continue;
+			if (snprintf(path, sizeof(path), "%s%s%s", dir->path, dir->path[0] ? "/" : "", name) >= sizeof(path)) {
+				errors_count += 1;
+				printf_error_verbose("Path too long '%s/%s'", dir->path, name);
+				continue;
+			}
+
+			roots_index = dir->root;
+			root_fd = watch_roots[roots_index];
+
+			if (event->mask & IN_ISDIR) {
+				if (!(event->mask & (IN_CREATE | IN_MOVED_TO))) continue;
+				if (skip_directory(name)) continue;
+				handle_directory(path, name);
+				watch_scan_directory(path);
+			} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				watch_file *tracked = watch_find(path);
+				tracked->present = 0;
+			} else {
+				watch_handle_file(path, name, event->mask & (IN_CREATE | IN_MOVED_TO));
+			}
+		}
+		handle_last_content_loaded();
+	}
+	return 0;
+}
+
+void watch_scan_directory(string path) {
+
+	// watch first, entries created while listing are then reported by events
+	watch_add_directory(path);
+
+	DIR *dir = root_opendir(path);
+	if (!dir) {
+		errors_count += 1;
+		printf_error_verbose("Error reading '%s'", path);
+		return;
+	}
+	char child[PATH_MAX];
+	struct dirent *d;
+	while ((d = readdir(dir)) && !limit_reached()) {
+		string name = d->d_name;
+		if (path_dot(name) || path_ddot(name)) continue;
+		if (context->option_unhidden && path_hidden(name)) continue;
+		if (snprintf(child, sizeof(child), "%s/%s", path, name) >= sizeof(child)) {
+			errors_count += 1;
+			printf_error_verbose("Path too long '%s/%s'", path, name);
+			continue;
+		}
+
+		if (d->d_type == DT_DIR) {
+			if (skip_directory(name)) continue;
+			handle_directory(child, name);
+			watch_scan_directory(child);
+		} else if (d->d_type == DT_REG || d->d_type == DT_UNKNOWN) {
+			watch_handle_file(child, name, 0);
+		}
+	}
+	closedir(dir);
+}
+
+void watch_handle_file(string path, string name, char created) {
+	struct stat st;
+
+	if (fstatat(root_fd, path, &st, AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode)) return;
+
+	watch_file *tracked = watch_find(path);
+	char replaced = created || st.st_ino != tracked->ino;
+	if (!tracked->present || (context->content_patterns_len && (replaced || st.st_size < tracked->size))) {
+		// created, replaced by a rename over it, or truncated and written again, search it whole
+		if (context->option_unique) inode_forget_file(&st);
+		handle_file(path, name, &st);
+		handle_last_content_loaded();
+	} else if (context->content_patterns_len && st.st_size > tracked->size) {
+		watch_search_appended(path, tracked, &st);
+	} else {
+		tracked->size = st.st_size;
+	}
+}
+
+void watch_search_appended(string path, watch_file *tracked, struct stat *st) {
+
+	int fd = openat(root_fd, path, O_RDONLY);
+	if (fd < 0) {
+		errors_count += 1;
+		return;
+	}
+	if (tracked->offset < 0 && watch_count_lines(fd, tracked)) {
+		close(fd);
+		return;
+	}
+
+	// from the end of the last complete line, the lines are searched once complete,
+	// the terms decide on the whole file so it is read from the start for them
+	filesize start = tracked->offset;
+	filesize from = context->content_terms_len ? 0 : start;
+	filesize len = st->st_size - from;
+	char *text = malloc(len + 1);
+	if (!text) {
+		printf_error("Out of memory");
+		close(fd);
+		return;
+	}
+	filesize done = 0;
+	while (done < len) {
+		ssize_t n = pread(fd, text + done, len - done, from + done);
+		if (n <= 0) break;
+		done += n;
+	}
+	close(fd);
+	text[done] = 0;
+	char *appended = text + min(start - from, done);
+	len = text + done - appended;
+
+	char *last = memrchr(appended, '\n', len);
+	if (last && !check_binary(appended, len)) {
+		char *end = last + 1;
+		char saved = *end;
+		*end = 0;
+		file_entry *file = &watch_file_entry;
+		root_path(file->path, path);
+		search_state state = {.line = tracked->lines + 1};
+		if (!context->content_terms_len || search_terms(file, text, end)) {
+			search_text(file, appended, appended, end, &state);
+			if (context->option_count) print_count(file, state.matches);
+		}
+		*end = saved;
+	}
+
+	if (last) {
+		tracked->lines += count_lines(appended, last + 1);
+		tracked->offset += last + 1 - appended;
+	}
+	tracked->size = start + len;
+	free(text);
+}
+
+int watch_count_lines(int fd, watch_file *tracked) {
+	char buffer[FIXED_BUFFER_SIZE];
+
+	// the lines of the part searched before, up to its last complete line
+	tracked->lines = 0;
+	tracked->offset = 0;
+	for (filesize offset = 0; offset < tracked->size;) {
+		ssize_t n = pread(fd, buffer, min(sizeof(buffer), tracked->size - offset), offset);
+		if (n <= 0) {
+			errors_count += 1;
+			return 1;
+		}
+		char *last = memrchr(buffer, '\n', n);
+		if (last) {
+			tracked->lines += count_lines(buffer, last + 1);
+			tracked->offset = offset + (last + 1 - buffer);
+		}
+		offset += n;
+	}
+	return 0;
+}
+
+// === serve
+
+void snapshot_add(string path, char hidden, struct stat *st) {
+
+	snapshot_entry *entry = snapshot_find(path);
+	if (!entry) {
+		if (snapshot_len == snapshot_capacity) {
+			size_t capacity = max(snapshot_capacity * 2, 1024);
+			snapshot_entry *grown = realloc(snapshot, capacity * sizeof(snapshot_entry));
+			if (!grown) {
+				printf_error("Out of memory");
+				return;
+			}
+			snapshot = grown;
+			snapshot_capacity = capacity;
+		}
+		entry = snapshot + snapshot_len++;
+		entry->path = strdup(path);
+		entry->name = basename_pointer(entry->path);
+		snapshot_index_insert(snapshot_len - 1);
+	} else if (entry->removed) {
+		snapshot_removed -= 1;
+	}
+	entry->removed = 0;
+	entry->hidden = hidden;
+	entry->mode = st->st_mode;
+	entry->size = st->st_size;
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->mtime = st->st_mtim;
+}
+
+snapshot_entry *snapshot_find(string path) {
+	if (!snapshot_index_capacity) return 0;
+
+	size_t i = hash_bytes(0xcbf29ce484222325ull, path, strlen(path)) & (snapshot_index_capacity - 1);
+	while (snapshot_index[i]) {
+		snapshot_entry *entry = snapshot + snapshot_index[i] - 1;
+		if (str_equals(entry->path, path)) return entry;
+		i = (i + 1) & (snapshot_index_capacity - 1);
+	}
+	return 0;
+}
+
+void snapshot_index_insert(size_t index) {
+
+	if ((index + 1) * 2 >= snapshot_index_capacity) {
+		free(snapshot_index);
+		snapshot_index_capacity = max(snapshot_index_capacity * 2, 2048);
+		snapshot_index = calloc(snapshot_index_capacity, sizeof(size_t));
+		if (!snapshot_index) {
+			printf_error("Out of memory");
+			exit(ERROR_INTERNAL);
+		}
+		// the entries before are placed again
+		for_each(i, index) {
+			snapshot_index_insert(i);
+		}
+	}
+
+	string path = snapshot[index].path;
+	size_t i = hash_bytes(0xcbf29ce484222325ull, path, strlen(path)) & (snapshot_index_capacity - 1);
+	while (snapshot_index[i]) {
+		i = (i + 1) & (snapshot_index_capacity - 1);
+	}
+	snapshot_index[i] = index + 1;
+}
+
+void snapshot_scan(string path, char hidden) {
+
+	// watch first, entries created while listing are then reported by events
+	watch_add_directory(path);
+
+	DIR *dir = root_opendir(path);
+	if (!dir) {
+		errors_count += 1;
+		printf_error_verbose("Error reading '%s'", path);
+		return;
+	}
+	char child[PATH_MAX];
+	struct dirent *d;
+	while ((d = readdir(dir))) {
+		string name = d->d_name;
+		if (path_dot(name) || path_ddot(name)) continue;
+		if (snprintf(child, sizeof(child), "%s%s%s", path_dot(path) ? "" : path, path_dot(path) ? "" : "/", name) >= sizeof(child)) {
+			errors_count += 1;
+			printf_error_verbose("Path too long '%s/%s'", path, name);
+			continue;
+		}
+		snapshot_scan_entry(child, hidden || path_hidden(name));
+	}
+	closedir(dir);
+}
+
+void snapshot_scan_entry(string path, char hidden) {
+	struct stat st;
+
+	if (fstatat(root_fd, path, &st, AT_SYMLINK_NOFOLLOW)) {
+		errors_count += 1;
+		printf_error_verbose("Error reading '%s'", path);
+		return;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		if (skip_directory(basename_pointer(path))) return;
+		snapshot_add(path, hidden, &st);
+		snapshot_scan(path, hidden);
+	} else if (S_ISREG(st.st_mode)) {
+		snapshot_add(path, hidden, &st);
+	}
+}
+
+char snapshot_pruned(snapshot_entry *entry) {
+	char parent[PATH_MAX];
+
+	// the parents are added before their entries, so they are decided first
+	size_t len = entry->name - entry->path;
+	if (!len) return 0;
+	memcpy(parent, entry->path, len - 1);
+	parent[len - 1] = 0;
+	snapshot_entry *found = snapshot_find(parent);
+	entry->pruned = found && found->pruned;
+	return entry->pruned;
+}
+
+void snapshot_remove(string path, char directory) {
+	snapshot_entry *entry = snapshot_find(path);
+	if (entry) snapshot_mark_removed(entry);
+	if (!directory) return;
+
+	// a directory moved away takes its entries with it
+	size_t len = strlen(path);
+	for_each(i, snapshot_len) {
+		if (!strncmp(snapshot[i].path, path, len) && snapshot[i].path[len] == '/') snapshot_mark_removed(snapshot + i);
+	}
+}
+
+void snapshot_mark_removed(snapshot_entry *entry) {
+	if (entry->removed) return;
+	entry->removed = 1;
+	snapshot_removed += 1;
+}
+
+void snapshot_compact() {
+	if (!snapshot_removed || snapshot_removed * 2 < snapshot_len) return;
+
+	// the entries keep their order, parents before their entries, and are placed again in a new index
+	size_t len = 0;
+	for_each(i, snapshot_len) {
+		if (snapshot[i].removed) {
+			free(snapshot[i].path);
+		} else {
+			snapshot[len++] = snapshot[i];
+		}
+	}
+	snapshot_len = len;
+	snapshot_removed = 0;
+	free(snapshot_index);
+	snapshot_index = 0;
+	snapshot_index_capacity = 0;
+	for_each(i, snapshot_len) {
+		snapshot_index_insert(i);
+	}
+}
+
+void snapshot_update() {
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX];
+
+	struct pollfd pending = {.fd = watch_fd, .events = POLLIN};
+	while (poll(&pending, 1, 0) > 0) {
+		ssize_t len = read(watch_fd, buffer, sizeof(buffer));
+		if (len <= 0) return;
+
+		for (char *cursor = buffer; cursor < buffer + len;) {
+			struct inotify_event *event = (struct inotify_event *)cursor;
+			cursor += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				// events were lost, the snapshot is taken again
+				for_each(i, snapshot_len) {
+					snapshot_mark_removed(snapshot + i);
+				}
+				snapshot_scan(".", 0);
+				continue;
+			}
+			if (event->wd < 0 || event->wd >= watch_dirs_capacity || !watch_dirs[event->wd].path) continue;
+			watch_dir *dir = watch_dirs + event->wd;
+			if (event->mask & IN_IGNORED) {
+				free(dir->path);
+				dir->path = 0;
+				continue;
+			}
+			if (!event->len) continue;
+
+			snapshot_entry *parent = dir->path[0] ? snapshot_find(dir->path) : 0;
+			char hidden = (parent && parent->hidden) || path_hidden(event->name);
+			if (snprintf(path, sizeof(path), "%s%s%s", dir->path, dir->path[0] ? "/" : "", event->name) >= sizeof(path)) continue;
+
+			if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				snapshot_remove(path, (event->mask & IN_ISDIR) != 0);
+			} else {
+				snapshot_scan_entry(path, hidden);
+			}
+		}
+	}
+	snapshot_compact();
+}
+
+void snapshot_search() {
+	for_each(i, snapshot_len) {
+		snapshot[i].pruned = 0;
+	}
+	for_each(i, snapshot_len) {
+		if (limit_reached()) break;
+		snapshot_entry *entry = snapshot + i;
+		if (entry->removed) continue;
+		if (context->option_unhidden && entry->hidden) continue;
+		if (context->metadata_directories && snapshot_pruned(entry)) continue;
+
+		struct stat st = {
+			.st_mode = entry->mode,
+			.st_size = entry->size,
+			.st_dev = entry->dev,
+			.st_ino = entry->ino,
+			.st_mtim = entry->mtime,
+		};
+		if (S_ISDIR(entry->mode)) {
+			if (!match_directory_metadata(&st)) {
+				entry->pruned = 1;
+				continue;
+			}
+			handle_directory(entry->path, entry->name);
+		} else {
+			handle_file(entry->path, entry->name, &st);
+		}
+	}
+	handle_last_content_loaded();
+}
+
+int serve_socket_path(struct sockaddr_un *address) {
+
+	char root[PATH_MAX];
+	if (!realpath(roots_count ? roots[0] : ".", root)) {
+		printf_error("Failed to find '%s'", roots_count ? roots[0] : ".");
+		return 1;
+	}
+	// one server for each root
+	unsigned long long hash = hash_bytes(0xcbf29ce484222325ull, root, strlen(root));
+
+	// in a directory only the user can enter, the runtime one or a private one in /tmp
+	char dir[PATH_MAX];
+	string runtime = getenv("XDG_RUNTIME_DIR");
+	if (runtime && runtime[0]) {
+		snprintf(dir, sizeof(dir), "%s", runtime);
+	} else {
+		snprintf(dir, sizeof(dir), "/tmp/mfg-%d", getuid());
+		if (mkdir(dir, 0700) && errno != EEXIST) {
+			printf_error("Could not create '%s'", dir);
+			return 1;
+		}
+	}
+	struct stat st;
+	if (lstat(dir, &st) || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+		printf_error("Not a private directory '%s'", dir);
+		return 1;
+	}
+
+	address->sun_family = AF_UNIX;
+	int len = snprintf(address->sun_path, sizeof(address->sun_path), "%s/mfg-%016llx.sock", dir, hash);
+	if (len >= sizeof(address->sun_path)) {
+		printf_error("Socket path too long '%s'", address->sun_path);
+		return 1;
+	}
+	return 0;
+}
+
+char serve_peer_trusted(int fd) {
+	// only processes of the same user, the queries see the whole tree and the results reach the terminal
+	struct ucred peer;
+	socklen_t len = sizeof(peer);
+	return !getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &len) && peer.uid == getuid();
+}
+
+void serve_stop(int sig) {
+	unlink(serve_socket);
+	_exit(0);
+}
 
-		pattern *first = 0;
-		for_each(i, content_patterns_len) {
-			pattern *p = content_patterns + i;
+void serve_unlink() {
+	unlink(serve_socket);
+}
 
-			while (p->match_start && p->match_start < cursor) {
-				match_pattern(p, cursor, text_end);
-			}
+int serve_run() {
+
+	struct sockaddr_un address = {0};
+	if (serve_socket_path(&address)) return 1;
+	if (roots_count && root_open(roots[0])) return 1;
+	roots_count = 0;
+
+	int server = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	unlink(address.sun_path);
+	// created without access for the others, the directory is private too
+	mode_t mask = umask(077);
+	int bound = server >= 0 && !bind(server, (struct sockaddr *)&address, sizeof(address));
+	umask(mask);
+	if (!bound || listen(server, SERVE_BACKLOG)) {
+		printf_error("Could not listen on '%s'", address.sun_path);
+		return 1;
+	}
+	// removed when stopped, a restarted server binds the same path again
+	strcpy(serve_socket, address.sun_path);
+	atexit(serve_unlink);
+	signal(SIGINT, serve_stop);
+	signal(SIGTERM, serve_stop);
+	signal(SIGHUP, serve_stop);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (watch_init()) return 1;
+	watch_add_root();
+	snapshot_scan(".", 0);
+	printf_error_verbose("Serving %zu entries on '%s'", snapshot_len, address.sun_path);
+
+	serve_client *clients = calloc(SERVE_CLIENTS, sizeof(serve_client));
+	if (!clients) {
+		printf_error("Out of memory");
+		return 1;
+	}
+	for_each(i, SERVE_CLIENTS) {
+		clients[i].fd = -1;
+	}
+
+	size_t queued = 0;
+	struct pollfd events[2 + SERVE_CLIENTS];
+	int polled[2 + SERVE_CLIENTS];
+	while (1) {
 
-			if (p->match_start && (!first || first->match_start > p->match_start)) {
-				first = p;
+		// the clients send their queries concurrently, the complete ones wait their turn
+		size_t free_slots = 0, reading = 0;
+		serve_client *next = 0;
+		nfds_t count = 2;
+		for_each(i, SERVE_CLIENTS) {
+			serve_client *client = clients + i;
+			if (client->fd < 0) {
+				free_slots += 1;
+			} else if (client->queued) {
+				if (!next || client->queued < next->queued) next = client;
+			} else {
+				events[count] = (struct pollfd){.fd = client->fd, .events = POLLIN};
+				polled[count++] = i;
+				reading += 1;
 			}
 		}
-		if (!first) break;
+		// a full table leaves the next clients in the backlog
+		events[0] = (struct pollfd){.fd = free_slots ? server : -1, .events = POLLIN};
+		events[1] = (struct pollfd){.fd = watch_fd, .events = POLLIN};
 
-		while (1) {
-			line_end = memchr_end(cursor, '\n', text_end);
-			if (line_end > first->match_start) break;
-			ADVANCE_CURSOR
+		if (poll(events, count, next ? 0 : reading ? SERVE_CLIENT_TIMEOUT : -1) < 0) {
+			if (errno == EINTR) continue;
+			return 1;
 		}
+		if (events[1].revents) snapshot_update();
+		for (nfds_t i = 2; i < count; i++) {
+			if (events[i].revents) serve_client_read(clients + polled[i], &queued);
+		}
+		if (events[0].revents) serve_accept(server, clients);
 
-		if (line_traces_capacity && line_traces_count) {
-			for_each(i, line_traces_count) {
-				int offset = line_traces_count - i;
-				print_search_match_around(file, line - offset,
-										  LINE_TRACES(line_traces_index - offset * 2),
-										  LINE_TRACES(line_traces_index - offset * 2 + 1));
-			}
-			line_traces_count = 0;
+		nanos now = now_ns();
+		for_each(i, SERVE_CLIENTS) {
+			serve_client *client = clients + i;
+			if (client->fd < 0 || client->queued) continue;
+			if (now - client->accepted > SERVE_CLIENT_TIMEOUT * 1000000ull) serve_client_close(client);
 		}
 
-		print_search_match(file, line, first->match_start, first->match_end, cursor, line_end, first->index);
-		pending_around_lines = around_lines;
+		// one query at a time, all of them with the same ring and buffers, the others are read meanwhile
+		if (next) {
+			snapshot_update();
+			serve_query(next);
+			serve_client_close(next);
+			// the root of the client pointed in its query
+			roots = 0;
+			roots_count = 0;
+		}
+	}
+	return 0;
+}
 
-		cursor = line_end + 1;
-		line += 1;
+void serve_accept(int server, serve_client *clients) {
+	for_each(i, SERVE_CLIENTS) {
+		serve_client *client = clients + i;
+		if (client->fd >= 0) continue;
 
-		match_pattern(first, cursor, text_end);
+		client->fd = accept4(server, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client->fd < 0) return;
+		if (!serve_peer_trusted(client->fd)) {
+			serve_client_close(client);
+			continue;
+		}
+		client->len = 0;
+		client->queued = 0;
+		client->failed = 0;
+		client->accepted = now_ns();
 	}
+}
 
-	while ((pending_around_lines || dump) && cursor < text_end) {
-		line_end = memchr_end(cursor, '\n', text_end);
-		ADVANCE_CURSOR
+void serve_client_read(serve_client *client, size_t *queued) {
+
+	ssize_t n = read(client->fd, client->query + client->len, sizeof(client->query) - client->len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+	if (n < 0) {
+		serve_client_close(client);
+		return;
 	}
+	client->len += n;
+	// the end of the query, or all of it that fits
+	if (!n || client->len == sizeof(client->query)) client->queued = ++*queued;
 }
 
-inline void print_match(file_entry *file) {
-	printf_output("%s", file->path);
+void serve_client_close(serve_client *client) {
+	close(client->fd);
+	client->fd = -1;
 }
-inline void print_match_path(string path) {
-	if (!roots_count) {
-		printf_output("%s", path);
-	} else {
-		const char *sep = roots[roots_index][strlen(roots[roots_index]) - 1] == '/' ? "" : "/";
-		printf_output("%s%s%s", roots[roots_index], sep, path);
+
+ssize_t serve_client_write(void *cookie, const char *data, size_t len) {
+	serve_client *client = cookie;
+
+	// a client that stops reading loses the rest of its results, instead of stalling the next ones
+	size_t done = 0;
+	while (!client->failed && done < len) {
+		ssize_t n = write(client->fd, data + done, len - done);
+		if (n > 0) {
+			done += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR) continue;
+		struct pollfd writable = {.fd = client->fd, .events = POLLOUT};
+		if (n < 0 && errno == EAGAIN && poll(&writable, 1, SERVE_CLIENT_TIMEOUT) > 0) continue;
+		client->failed = 1;
+		// the search stops at the matches so far
+		if (matches_count) context->option_limit = matches_count;
 	}
+	return len;
 }
 
-void print_search_match(file_entry *file, filesize line, char *result_start, char *result_end, char *line_start, char *line_end, int pi) {
+void serve_query(serve_client *client) {
 
-	int print_limit = DEFAULT_PRINT_LIMIT;
-	char line_pre[print_limit + 3], line_post[print_limit + 3];
+	// the arguments of the client, separated by nulls
+	char *buffer = client->query;
+	size_t len = client->len;
+	char *argv[SERVE_QUERY_ARGS] = {"mfg"};
+	int argc = 1;
+	for (char *arg = buffer; arg < buffer + len && argc < SERVE_QUERY_ARGS; arg += strlen(arg) + 1) {
+		if (!memchr(arg, 0, buffer + len - arg)) break;
+		argv[argc++] = arg;
+	}
 
-	if (result_end > line_end) result_end = line_end;
+	reset_query();
+	reset_search();
+	cookie_io_functions_t functions = {.write = serve_client_write};
+	FILE *stream = fopencookie(client, "w", functions);
+	if (!stream) return;
 
-	int pattern_len = (result_end) - (result_start);
-	int line_pre_len = (result_start) - (line_start);
-	int line_post_len = (line_end) - (result_end);
+	// a root only prefixes the paths like the client would print them, the tree searched is the one served
+	if (handle_args(argc, argv) || roots_count > 1 || context->option_help || context->option_serve || context->option_watch || context->option_result_cache || context->option_learn) {
+		fprintf(stream, "mfg: Invalid query\n");
+		fclose(stream);
+		return;
+	}
+	init_query();
+	if (loading_setup()) {
+		fprintf(stream, "mfg: Could not start loading\n");
+		fclose(stream);
+		return;
+	}
 
-#define ELLIPSES "..."
-#define PRINT_OMITTED(TEMPLATE, ...)                     \
-	if (option_name_omit) {                              \
-		printf_output(TEMPLATE, ##__VA_ARGS__);          \
-	} else if (option_content_omit) {                    \
-		printf_output("%s%s%s:%s%ld%s",                  \
-					  COLOR_PATH, file->path, COLOR_SEP, \
-					  COLOR_COL, line, COLOR_RESET);     \
-	} else {                                             \
-		const char *sep = option_table ? "\t" : "";      \
-		printf_output("%s%s%s:%s%ld%s:%s" TEMPLATE,      \
-					  COLOR_PATH, file->path, COLOR_SEP, \
-					  COLOR_COL, line, COLOR_SEP,        \
-					  sep, ##__VA_ARGS__);               \
+	output = stream;
+	snapshot_search();
+	if (context->option_count > 1) {
+		printf_output("%s%zu%s", COLOR_COL, matches_count, COLOR_RESET);
 	}
+	if (errors_count) {
+		fprintf(stream, "mfg: %d access errors occurred\n", errors_count);
+	}
+	fclose(stream);
+	output = stdout;
+}
 
-	if (option_content_only) {
-		PRINT_OMITTED("%s%.*s%s",
-					  COLOR_MATCH(pi), pattern_len, result_start,
-					  COLOR_RESET)
-	} else if (option_plain || line_end - line_start < print_limit) {
-		memcpy(line_pre, line_start, line_pre_len);
-		memcpy(line_post, line_end - line_post_len, line_post_len);
+int client_run(int argc, char *argv[]) {
 
-		PRINT_OMITTED("%s%.*s%s%.*s%s%.*s",
-					  COLOR_RESET, line_pre_len, line_pre,
-					  COLOR_MATCH(pi), pattern_len, result_start,
-					  COLOR_RESET, line_post_len, line_post)
-	} else if (result_end - line_start < print_limit) {
-		memcpy(line_pre, line_start, line_pre_len);
-		line_post_len = print_limit - (result_end - line_start);
-		memcpy(line_post, line_end - line_post_len, line_post_len);
+	struct sockaddr_un address = {0};
+	if (serve_socket_path(&address)) return 1;
 
-		PRINT_OMITTED("%s%.*s%s%.*s%s%.*s"
-					  "%s%s%s",
-					  COLOR_RESET, line_pre_len, line_pre,
-					  COLOR_MATCH(pi), pattern_len, result_start,
-					  COLOR_RESET, line_post_len, line_post,
-					  COLOR_DIM, ELLIPSES,
-					  COLOR_RESET);
-	} else {
-		int space_pre = (print_limit - pattern_len) / 2;
-		line_pre_len = min(line_pre_len, space_pre);
-		line_post_len = min(line_post_len, print_limit - pattern_len - line_pre_len);
+	int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server < 0 || connect(server, (struct sockaddr *)&address, sizeof(address))) {
+		printf_error("No server on '%s', start one with mfg -S", address.sun_path);
+		return 1;
+	}
+	if (!serve_peer_trusted(server)) {
+		printf_error("The server on '%s' is run by another user", address.sun_path);
+		return 1;
+	}
 
-		memcpy(line_pre, result_start - line_pre_len, line_pre_len);
-		memcpy(line_post, result_end, line_post_len);
+	// the query, then the root as given, the server searches its own and prints the paths under this one
+	for (int i = 1; i < argc && !str_equals(argv[i], "--"); i++) {
+		if (write_all(server, argv[i], strlen(argv[i]) + 1)) return 1;
+	}
+	if (roots_count && (write_all(server, "--", 3) || write_all(server, roots[0], strlen(roots[0]) + 1))) return 1;
+	shutdown(server, SHUT_WR);
 
-		PRINT_OMITTED("%s%s%s"
-					  "%.*s%s%.*s%s%.*s"
-					  "%s%s%s",
-					  COLOR_DIM, ELLIPSES,
-					  COLOR_RESET, line_pre_len, line_pre,
-					  COLOR_MATCH(pi), pattern_len, result_start,
-					  COLOR_RESET, line_post_len, line_post,
-					  COLOR_DIM, ELLIPSES,
-					  COLOR_RESET);
+	char buffer[FIXED_BUFFER_SIZE];
+	ssize_t n;
+	while ((n = read(server, buffer, sizeof(buffer))) > 0) {
+		if (write_all(STDOUT_FILENO, buffer, n)) break;
 	}
+	close(server);
+	return 0;
 }
 
-void print_search_match_around(file_entry *file, filesize line, char *line_start, char *line_end) {
-	print_search_match(file, line, line_start, line_start, line_start, line_end, 0);
+int write_all(int fd, char *data, size_t len) {
+	while (len) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 1;
+		data += n;
+		len -= n;
+	}
+	return 0;
 }
 
-void dump_file(file_entry *file) {
+// === stats
 
-	char *const text = file->buffer.start;
-	filesize const text_len = file->buffer.size;
-	char *const text_end = text + text_len;
+nanos now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-	char *cursor = text;
-	filesize line = 1;
-	char *line_end;
+void stats_record(stage_stats *stage, nanos start, size_t count, size_t bytes) {
+	stage->count += count;
+	stage->bytes += bytes;
+	stage->time += now_ns() - start;
+}
 
-	while (cursor < text_end) {
-		line_end = memchr_end(cursor, '\n', text_end);
+void stats_record_latency(nanos latency) {
+	size_t bucket = 0;
+	for (nanos us = latency / 1000; us && bucket < STATS_LATENCY_BUCKETS - 1; us >>= 1) {
+		bucket += 1;
+	}
+	stats.read_latency[bucket] += 1;
+}
 
-		print_search_match_around(file, line, cursor, line_end);
+void print_stats() {
+
+#define PRINT_STAGE(STAGE, DESC)                                      \
+	fprintf(stderr, "  %-10s %12zu %14zu %12.3f  %s\n", #STAGE,        \
+			stats.STAGE.count, stats.STAGE.bytes, stats.STAGE.time / 1e6, \
+			DESC);
+
+	fprintf(stderr, "mfg: stats\n");
+	fprintf(stderr, "  %-10s %12s %14s %12s\n", "stage", "count", "bytes", "time (ms)");
+	PRINT_STAGE(list, "directories listed")
+	PRINT_STAGE(stat, "entries with a batched statx")
+	PRINT_STAGE(open, "files opened")
+	PRINT_STAGE(read, "reads completed, time blocked waiting")
+	PRINT_STAGE(overflow, "overflow re-reads")
+	PRINT_STAGE(sparse, "overflow re-reads of the data of sparse files")
+	PRINT_STAGE(binary, "binary checks")
+	PRINT_STAGE(search, "files searched, without output")
+	PRINT_STAGE(output, "lines printed")
+	fprintf(stderr, "  binary skips %zu, class skips %zu, metadata skips %zu, hole bytes %zu, result cache hits %zu, matches %zu\n",
+			stats.binary_skips, stats.class_skips, stats.metadata_skips, stats.hole_bytes, stats.result_cache_hits, matches_count);
+
+	fprintf(stderr, "  read latency (submit to completion)\n");
+	for_each(i, STATS_LATENCY_BUCKETS) {
+		if (!stats.read_latency[i]) continue;
+		fprintf(stderr, "    < %8llu us %12zu\n", 1ull << i, stats.read_latency[i]);
+	}
 
-		cursor = line_end + 1;
-		line += 1;
+	struct rusage usage;
+	if (!getrusage(RUSAGE_SELF, &usage)) {
+		fprintf(stderr, "  peak memory %ld KiB\n", usage.ru_maxrss);
 	}
 }
 
@@ -887,24 +4503,28 @@ int init_pattern(pattern *p) {
 		PATTERN_CAST(any) {
 			P->len = strlen(P->arg);
 			strcpy(P->text, P->arg);
+			init_literal(P, P->len);
 		}
 		PATTERN_CAST(start) {
 			P->len = strlen(P->arg);
 			sprintf(P->text, "\n%s", P->arg);
+			init_literal(P, P->len + 1);
 		}
 		PATTERN_CAST(end) {
 			P->len = strlen(P->arg);
 			sprintf(P->text, "%s\n", P->arg);
+			init_literal(P, P->len + 1);
 		}
 		PATTERN_CAST(wrap) {
 			P->start.len = strlen(P->start.arg);
 			P->end.len = strlen(P->end.arg);
 			strcpy(P->start.text, P->start.arg);
 			strcpy(P->end.text, P->end.arg);
+			init_literal(&P->start, P->start.len);
+			init_literal(&P->end, P->end.len);
 		}
 		PATTERN_CAST(regex) {
-			int flags = REG_EXTENDED | (option_content_multiline ? 0 : REG_NEWLINE) | (option_content_case ? REG_ICASE : 0);
-			int ret = regcomp(&P->regex, P->arg, flags);
+			int ret = regcomp(&P->regex, P->arg, regex_flags());
 			if (ret) {
 				printf_error("Could not parse regex '%s'", P->arg);
 				return 1;
@@ -914,8 +4534,136 @@ int init_pattern(pattern *p) {
 	return 0;
 }
 
+void init_byte_frequency() {
+
+	// bytes of text and source code, from the most to the least frequent
+	const char *frequent = " e\tta_osirnlcdpmu\nhfg.(),;=bEyTvSIwAkxR\"NLO-C>D*P0/FM:1<{}U[]2Bj'H#&qz3G45V+!X9876KJYWQZ|%$@\\?~^`";
+
+	int len = strlen(frequent);
+	for_each(i, len) {
+		byte_frequency[(unsigned char)frequent[i]] = len - i;
+	}
+}
+
+int literal_frequency(char *text, int len) {
+	int frequency = 256;
+	for_each(i, len) {
+		unsigned char c = text[i];
+		int f = byte_frequency[c];
+		if (context->option_content_case) f = max(byte_frequency[tolower(c)], byte_frequency[toupper(c)]);
+		frequency = min(frequency, f);
+	}
+	return frequency;
+}
+
+int pattern_frequency(pattern *p) {
+	switch (p->type) {
+	case T_any:
+	case T_start:
+	case T_end:
+		return literal_frequency(p->as.any.arg, strlen(p->as.any.arg));
+	case T_wrap:
+		return min(literal_frequency(p->as.wrap.start.arg, p->as.wrap.start.len),
+				   literal_frequency(p->as.wrap.end.arg, p->as.wrap.end.len));
+	}
+	return 256;
+}
+
+int term_cost(pattern *p) {
+	return p->type == T_regex ? 2 : p->type == T_wrap ? 1 : 0;
+}
+
+int terms_compare(const void *a, const void *b) {
+	pattern *x = *(pattern **)a, *y = *(pattern **)b;
+
+	// literals cost the least, then wrapped patterns and regexes,
+	// then the terms that reject a file when not found go first, rarest first
+	int cost = term_cost(x) - term_cost(y);
+	if (cost) return cost;
+	if (x->negated != y->negated) return x->negated - y->negated;
+	int order = pattern_frequency(x) - pattern_frequency(y);
+	if (x->negated) order = -order;
+	return order ? order : x->index - y->index;
+}
+
+void init_terms() {
+	char negated = 0;
+	for_each(i, context->content_patterns_len) {
+		pattern *p = context->content_patterns + i;
+		if (p->type == 0 || p->type == T_star) continue;
+		context->content_terms[context->content_terms_len++] = p;
+		negated |= p->negated;
+	}
+	if (!context->option_content_all && !negated) {
+		context->content_terms_len = 0;
+		return;
+	}
+	qsort(context->content_terms, context->content_terms_len, sizeof(pattern *), terms_compare);
+}
+
+int regex_flags() {
+	return REG_EXTENDED | (context->option_content_multiline ? 0 : REG_NEWLINE) | (context->option_content_case ? REG_ICASE : 0);
+}
+
+void init_literal(pattern_any *P, int len) {
+
+	// the two rarest bytes of the needle are the ones scanned for
+	P->rare1 = 0;
+	P->rare2 = 0;
+	for_each(i, len) {
+		unsigned char c = P->text[i];
+		if (byte_frequency[c] < byte_frequency[(unsigned char)P->text[P->rare1]]) P->rare1 = i;
+	}
+	int rare2_frequency = 257;
+	for_each(i, len) {
+		unsigned char c = P->text[i];
+		if (i == P->rare1 || c == (unsigned char)P->text[P->rare1]) continue;
+		if (byte_frequency[c] < rare2_frequency) {
+			P->rare2 = i;
+			rare2_frequency = byte_frequency[c];
+		}
+	}
+	if (rare2_frequency == 257) P->rare2 = len - 1;
+}
+
+char *literal_find(pattern_any *P, int len, char *text, char *text_end) {
+
+	if (len == 0) return text;
+	if (text_end - text < len) return 0;
+	if (len == 1) return memchr(text, P->text[0], text_end - text);
+
+	char *last = text_end - len;
+	char *cursor = text;
+	char c1 = P->text[P->rare1];
+	char c2 = P->text[P->rare2];
+
+#ifdef __SSE2__
+	// 16 candidate starts at a time, only the ones with both rare bytes in place are compared
+	__m128i v1 = _mm_set1_epi8(c1);
+	__m128i v2 = _mm_set1_epi8(c2);
+	while (cursor + 15 <= last) {
+		__m128i b1 = _mm_loadu_si128((__m128i *)(cursor + P->rare1));
+		__m128i b2 = _mm_loadu_si128((__m128i *)(cursor + P->rare2));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(b1, v1), _mm_cmpeq_epi8(b2, v2)));
+		while (mask) {
+			char *candidate = cursor + __builtin_ctz(mask);
+			if (!memcmp(candidate, P->text, len)) return candidate;
+			mask &= mask - 1;
+		}
+		cursor += 16;
+	}
+#endif
+	for (; cursor <= last; cursor++) {
+		cursor = memchr(cursor + P->rare1, c1, last - cursor + 1);
+		if (!cursor) return 0;
+		cursor -= P->rare1;
+		if (cursor[P->rare2] == c2 && !memcmp(cursor, P->text, len)) return cursor;
+	}
+	return 0;
+}
+
 char match_pattern(pattern *p, char *text_start, char *text_end) {
-	int text_len = text_end - text_start;
+	size_t text_len = text_end - text_start;
 
 	p->match_start = 0;
 	p->match_end = 0;
@@ -923,7 +4671,7 @@ char match_pattern(pattern *p, char *text_start, char *text_end) {
 	if (p->type == 0) {
 		PATTERN_CAST(any) {
 
-			char *match = memmem(text_start, text_len, P->text, P->len);
+			char *match = literal_find(P, P->len, text_start, text_end);
 			if (!match) return 0;
 			p->match_start = match;
 			p->match_end = p->match_start + P->len;
@@ -931,12 +4679,12 @@ char match_pattern(pattern *p, char *text_start, char *text_end) {
 		}
 		PATTERN_CAST(start) {
 
-			if (!memcmp(text_start, P->text + 1, P->len)) {
+			if (text_len >= P->len && !memcmp(text_start, P->text + 1, P->len)) {
 				p->match_start = text_start;
 				p->match_end = p->match_start + P->len;
 				return 1;
 			}
-			char *match = memmem(text_start, text_len, P->text, P->len + 1);
+			char *match = literal_find(P, P->len + 1, text_start, text_end);
 			if (!match) return 0;
 			p->match_start = match + 1;
 			p->match_end = p->match_start + P->len;
@@ -944,13 +4692,13 @@ char match_pattern(pattern *p, char *text_start, char *text_end) {
 		}
 		PATTERN_CAST(end) {
 
-			char *match = memmem(text_start, text_len, P->text, P->len + 1);
+			char *match = literal_find(P, P->len + 1, text_start, text_end);
 			if (match) {
 				p->match_start = match;
 				p->match_end = p->match_start + P->len;
 				return 1;
 			}
-			if (!memcmp(text_end - P->len, P->text, P->len)) {
+			if (text_len >= P->len && !memcmp(text_end - P->len, P->text, P->len)) {
 				p->match_start = text_end - P->len;
 				p->match_end = text_end;
 				return 1;
@@ -959,19 +4707,19 @@ char match_pattern(pattern *p, char *text_start, char *text_end) {
 		PATTERN_CAST(wrap) {
 
 			char *start = text_start;
-			while (text_start < text_end) {
-				char *match_start = memmem(start, text_end - start, P->start.text, P->start.len);
+			while (start < text_end) {
+				char *match_start = literal_find(&P->start, P->start.len, start, text_end);
 				if (!match_start) return 0;
-				char *match_limit = text_end;
-				if (!option_content_multiline) {
-					match_limit = memchr(match_start + P->start.len, '\n', text_end - match_start - P->start.len);
-					if (!match_limit) return 0;
-				}
-				char *match_end = memmem(match_start + P->start.len, match_limit - (match_start + P->start.len), P->end.text, P->end.len);
-				if (!match_end) {
+				char *after = match_start + P->start.len;
+				char *match_limit = context->option_content_multiline ? text_end : memchr_end(after, '\n', text_end);
+
+				char *match_end = wrap_find_end(P, after, text_end);
+				if (!match_end) return 0;
+				if (match_end + P->end.len > match_limit) {
+					// not on the line of the start, the next start is after the line
 					start = match_limit + 1;
 					continue;
-				};
+				}
 
 				p->match_start = match_start;
 				p->match_end = match_end + P->end.len;
@@ -981,39 +4729,70 @@ char match_pattern(pattern *p, char *text_start, char *text_end) {
 		}
 		PATTERN_CAST(regex) {
 
-			regmatch_t pmatch[1];
-			pmatch[0].rm_so = 0;
-			pmatch[0].rm_eo = text_len;
+			// the offsets are ints, longer texts are searched in windows ending on a line end
+			char *start = text_start;
+			while (1) {
+				char *end = text_end;
+				if (end - start > REGEX_WINDOW) {
+					char *last = memrchr(start, '\n', REGEX_WINDOW);
+					end = last ? last + 1 : start + REGEX_WINDOW;
+				}
 
-			int ret = regexec(&P->regex, text_start, 1, pmatch, REG_STARTEND);
-			if (ret == REG_NOMATCH) return 0;
+				regmatch_t pmatch[1];
+				pmatch[0].rm_so = 0;
+				pmatch[0].rm_eo = end - start;
 
-			if (!ret) {
-				p->match_start = text_start + pmatch[0].rm_so;
-				p->match_end = text_start + pmatch[0].rm_eo;
-				return 1;
+				int ret = regexec(&P->regex, start, 1, pmatch, REG_STARTEND);
+				if (ret == REG_NOMATCH) {
+					if (end == text_end) return 0;
+					start = end;
+					continue;
+				}
 
-			} else {
-				char buffer[100];
-				regerror(ret, &P->regex, buffer, sizeof(buffer));
-				printf_error("Regex error: %s", buffer);
-				return 0;
+				if (!ret) {
+					p->match_start = start + pmatch[0].rm_so;
+					p->match_end = start + pmatch[0].rm_eo;
+					return 1;
+
+				} else {
+					char buffer[100];
+					regerror(ret, &P->regex, buffer, sizeof(buffer));
+					printf_error("Regex error: %s", buffer);
+					return 0;
+				}
 			}
 		}
 	}
 	return 0;
 }
 
+char *wrap_find_end(pattern_wrap *P, char *from, char *text_end) {
+
+	// the starts only move forward, so the end found for an earlier start holds until it is passed,
+	// every byte is searched for an end once and many starts without an end stay linear
+	if (P->end_limit != text_end || from < P->end_from || (P->end_at && from > P->end_at)) {
+		P->end_from = from;
+		P->end_limit = text_end;
+		P->end_at = literal_find(&P->end, P->end.len, from, text_end);
+	}
+	return P->end_at;
+}
+
+void pattern_rewind(pattern *p) {
+	// a new text, in a buffer that can be at the same address as the last one
+	if (p->type == T_wrap) p->as.wrap.end_limit = 0;
+}
+
 // === matching
 
 int match_name(string name) {
 
 #define CASE_MATCH(W, _, FUNCTION) \
 	case W:                        \
-		return FUNCTION(name, option_name_pattern, !option_name_case);
+		return FUNCTION(name, context->option_name_pattern, !context->option_name_case);
 
-	if (option_name_pattern && !str_equals(option_name_pattern, ".")) {
-		switch (option_name_mode) {
+	if (context->option_name_pattern && !str_equals(context->option_name_pattern, ".")) {
+		switch (context->option_name_mode) {
 			CASE_MATCH('p', "prefix", match_prefix_comma)
 			CASE_MATCH('s', "start", match_prefix_comma)
 			CASE_MATCH('e', "extension", match_postfix_comma)
@@ -1091,6 +4870,39 @@ int handle_arg_keyword(const char *desc, char *option, string possible, string m
 	return 0;
 }
 
+int handle_arg_number(const char *desc, size_t *option, string word) {
+	char *end;
+	long value = strtol(word, &end, 10);
+	if (!word[0] || *end || value < 0) {
+		printf_error("Invalid %s '%s'", desc, word);
+		return 1;
+	}
+	*option = value;
+	return 0;
+}
+
+int handle_arg_range(const char *desc, range *option, string units, const long long *scales, string word) {
+	char over = word[0] == '+';
+	char *end;
+	long long value = strtoll(word + over, &end, 10);
+	long long scale = scales[0];
+	if (end != word + over && *end && !end[1] && strchr(units, *end)) {
+		scale = scales[strchr(units, *end) - units];
+		end += 1;
+	}
+	if (end == word + over || *end || value < 0 || value > LLONG_MAX / scale) {
+		printf_error("Invalid %s '%s'", desc, word);
+		return 1;
+	}
+	// a plus for more than the value, at most the value otherwise
+	if (over) {
+		option->over = value * scale;
+	} else {
+		option->upto = value * scale;
+	}
+	return 0;
+}
+
 int handle_args(int argc, char *argv[]) {
 
 #define OPTION_CHECK(C, OPTION) \
@@ -1098,6 +4910,24 @@ int handle_args(int argc, char *argv[]) {
 		OPTION += 1;            \
 		break;
 
+#define OPTION_NUMBER(C, OPTION, DESC)                                  \
+	case C:                                                             \
+		if (argi == argc) {                                             \
+			printf_error("Missing value for the " DESC);                \
+			return 1;                                                   \
+		}                                                               \
+		if (handle_arg_number(DESC, &OPTION, argv[argi++])) return 1; \
+		break;
+
+#define OPTION_RANGE(C, OPTION, UNITS, DESC)                                                           \
+	case C:                                                                                            \
+		if (argi == argc) {                                                                            \
+			printf_error("Missing value for the " DESC);                                               \
+			return 1;                                                                                  \
+		}                                                                                              \
+		if (handle_arg_range(DESC, &OPTION, units_##UNITS, scales_##UNITS, argv[argi++])) return 1; \
+		break;
+
 #define HANDLE_END                 \
 	if (str_equals(arg, "--")) {   \
 		roots = argv + argi;       \
@@ -1112,21 +4942,36 @@ int handle_args(int argc, char *argv[]) {
 		HANDLE_END
 
 		if (!str_is_option(arg)) {
-			if (handle_arg_keyword("file type", &option_file_type,
+			if (handle_arg_keyword("file type", &context->option_file_type,
 								   possible_option_file_type,
 								   mappings_option_file_type, arg)) return 1;
 			break;
 		}
 		for (char *c = arg + 1; *c; c++) {
 			switch (*c) {
-				OPTION_CHECK('h', option_help)
-				OPTION_CHECK('b', option_bfs)
-				OPTION_CHECK('q', option_query)
-				OPTION_CHECK('p', option_plain)
-				OPTION_CHECK('m', option_monochrome)
-				OPTION_CHECK('t', option_table)
-				OPTION_CHECK('a', option_unhidden)
-				OPTION_CHECK('v', option_verbose)
+				OPTION_CHECK('h', context->option_help)
+				OPTION_CHECK('b', context->option_bfs)
+				OPTION_CHECK('q', context->option_query)
+				OPTION_CHECK('p', context->option_plain)
+				OPTION_CHECK('m', context->option_monochrome)
+				OPTION_CHECK('t', context->option_table)
+				OPTION_CHECK('a', context->option_unhidden)
+				OPTION_CHECK('v', context->option_verbose)
+				OPTION_CHECK('s', context->option_stats)
+				OPTION_CHECK('k', context->option_no_cache)
+				OPTION_CHECK('z', context->option_decompress)
+				OPTION_CHECK('j', context->option_parallel)
+				OPTION_CHECK('u', context->option_unique)
+				OPTION_CHECK('r', context->option_result_cache)
+				OPTION_CHECK('w', context->option_watch)
+				OPTION_CHECK('d', context->option_disk_order)
+				OPTION_CHECK('S', context->option_serve)
+				OPTION_CHECK('C', context->option_client)
+				OPTION_CHECK('i', context->option_input)
+				OPTION_CHECK('c', context->option_count)
+				OPTION_CHECK('g', context->option_learn)
+				OPTION_CHECK('P', context->option_pipeline)
+				OPTION_NUMBER('l', context->option_limit, "match limit")
 			default:
 				printf_error("Unknown general option '-%c'", *c);
 				return 1;
@@ -1140,25 +4985,28 @@ int handle_args(int argc, char *argv[]) {
 
 		if (!str_is_option(arg)) {
 			if (str_equals(arg, ".")) {
-				option_name_mode = 'a';
+				context->option_name_mode = 'a';
 			} else if (str_endswith(arg, ':')) {
-				if (handle_arg_keyword("name pattern type", &option_name_mode,
+				if (handle_arg_keyword("name pattern type", &context->option_name_mode,
 									   possible_option_name_mode,
 									   mappings_option_name_mode, arg)) return 1;
 				if (argi == argc) {
 					printf_error("Missing value for the name pattern");
 					return 1;
 				}
-				option_name_pattern = argv[argi++];
+				context->option_name_pattern = argv[argi++];
 			} else {
-				option_name_pattern = arg;
+				context->option_name_pattern = arg;
 			}
 			break;
 		}
 		for (char *c = arg + 1; *c; c++) {
 			switch (*c) {
-				OPTION_CHECK('n', option_name_omit)
-				OPTION_CHECK('i', option_name_case)
+				OPTION_CHECK('n', context->option_name_omit)
+				OPTION_CHECK('i', context->option_name_case)
+				OPTION_RANGE('s', context->option_size, option_size, "file size")
+				OPTION_RANGE('t', context->option_age, option_age, "file age")
+				OPTION_RANGE('d', context->option_directory_age, option_age, "directory age")
 			default:
 				printf_error("Unknown name option '-%c'", *c);
 				return 1;
@@ -1171,8 +5019,9 @@ int handle_args(int argc, char *argv[]) {
 		HANDLE_END
 
 		if (!str_is_option(arg)) {
-			pattern *p = content_patterns + content_patterns_len++;
-			p->index = content_patterns_len - 1;
+			pattern *p = context->content_patterns + context->content_patterns_len++;
+			p->index = context->content_patterns_len - 1;
+			p->negated = context->option_content_exclude > 0;
 
 			if (str_equals(arg, "--")) {
 				break;
@@ -1181,7 +5030,7 @@ int handle_args(int argc, char *argv[]) {
 
 			} else if (str_equals(arg, ".")) {
 				p->type = T_star;
-				dump_files = 1;
+				context->dump_files = 1;
 
 			} else if (str_endswith(arg, ':') && !str_equals(arg, ":")) {
 				if (handle_arg_keyword("content pattern type", &p->type,
@@ -1219,11 +5068,14 @@ int handle_args(int argc, char *argv[]) {
 		}
 		for (char *c = arg + 1; *c; c++) {
 			switch (*c) {
-				OPTION_CHECK('n', option_content_omit)
-				OPTION_CHECK('i', option_content_case)
-				OPTION_CHECK('o', option_content_only)
-				OPTION_CHECK('m', option_content_multiline)
-				OPTION_CHECK('a', option_content_around)
+				OPTION_CHECK('n', context->option_content_omit)
+				OPTION_CHECK('i', context->option_content_case)
+				OPTION_CHECK('o', context->option_content_only)
+				OPTION_CHECK('m', context->option_content_multiline)
+				OPTION_CHECK('a', context->option_content_around)
+				OPTION_CHECK('e', context->option_content_all)
+				OPTION_CHECK('x', context->option_content_exclude)
+				OPTION_NUMBER('l', context->option_content_limit, "per file match limit")
 			default:
 				printf_error("Unknown content option '-%c'", *c);
 				return 1;
@@ -1233,3 +5085,199 @@ int handle_args(int argc, char *argv[]) {
 
 	return 0;
 }
+
+// === library
+
+mfg_context *mfg_context_create() {
+	init_byte_frequency();
+	mfg_context *created = calloc(1, sizeof(mfg_context));
+	if (!created) return 0;
+	context = created;
+	reset_query();
+	return created;
+}
+
+void mfg_context_free(mfg_context *freed) {
+	if (!freed) return;
+	context = freed;
+	reset_query();
+	if (freed->loading) loading_release();
+	for_each(i, freed->argc) {
+		free(freed->argv[i]);
+	}
+	free(freed->argv);
+	free(freed);
+	context = &main_context;
+}
+
+int mfg_compile(mfg_context *compiled, int argc, char *argv[]) {
+
+	char **copy = calloc(argc + 1, sizeof(char *));
+	if (!copy) return 1;
+	copy[0] = strdup("mfg");
+	for_each(i, argc) {
+		copy[i + 1] = strdup(argv[i]);
+	}
+	for_each(i, argc + 1) {
+		if (copy[i]) continue;
+		// the context keeps its previous query
+		printf_error("Out of memory");
+		for_each(j, argc + 1) {
+			free(copy[j]);
+		}
+		free(copy);
+		return 1;
+	}
+
+	// the patterns point into the arguments, they are kept with the context
+	context = compiled;
+	reset_query();
+	for_each(i, compiled->argc) {
+		free(compiled->argv[i]);
+	}
+	free(compiled->argv);
+	compiled->argc = argc + 1;
+	compiled->argv = copy;
+	compiled->compiled = 0;
+
+	if (handle_args(compiled->argc, compiled->argv)) return 1;
+	if (roots_count) {
+		printf_error("The roots are given to each search");
+		roots = 0;
+		roots_count = 0;
+		return 1;
+	}
+	if (context->option_watch || context->option_result_cache || context->option_learn || context->option_help) {
+		printf_error("Watching, result caching, learning and help are not searches");
+		return 1;
+	}
+	init_query();
+	compiled->compiled = 1;
+	return 0;
+}
+
+long mfg_search(mfg_context *searched, const char *root, mfg_callback callback, void *data) {
+	if (!searched->compiled) return -1;
+
+	// the query and the reads of the context are used as they are, each search only switches to it
+	context = searched;
+	reset_search();
+	if (root_open((char *)root)) return -1;
+
+	char *root_arg = (char *)root;
+	roots = &root_arg;
+	roots_count = 1;
+	result_callback = callback;
+	result_callback_data = data;
+	metadata_refresh();
+
+	long result = 0;
+	if (loading_setup()) result = -1;
+
+	if (!result && paths_handle()) result = -1;
+	handle_last_content_loaded();
+	if (!result) result = matches_count;
+
+	result_callback = 0;
+	roots = 0;
+	roots_count = 0;
+	root_close();
+
+	if (context->option_stats) print_stats();
+	return result;
+}
+
+const char *mfg_help() {
+	return help;
+}
+
+int loading_setup() {
+
+	// the ring and buffers are reused, unless they were sized for the other kind of reads
+	if (context->loading && (context->skip_loading || context->loading_probe != context->probe_loading)) {
+		loading_release();
+	}
+	if (!context->skip_loading && !context->loading) {
+		if (init_loading()) return 1;
+		context->loading = 1;
+		context->loading_probe = context->probe_loading;
+	}
+	return 0;
+}
+
+void loading_release() {
+	io_uring_queue_exit(&context->ring);
+	free(context->files);
+	free(context->fixed_buffers);
+	context->files = 0;
+	context->fixed_buffers = 0;
+	context->loading = 0;
+}
+
+void reset_search() {
+	roots = 0;
+	roots_count = 0;
+	roots_index = 0;
+	errors_count = 0;
+	matches_count = 0;
+	memset(&stats, 0, sizeof(stats));
+	output = stdout;
+
+	free(inodes);
+	inodes = 0;
+	inodes_capacity = 0;
+	inodes_count = 0;
+}
+
+void reset_query() {
+	for_each(i, context->content_patterns_len) {
+		pattern *p = context->content_patterns + i;
+		if (p->type == T_regex) regfree(&p->as.regex.regex);
+	}
+	context->content_patterns_len = 0;
+	context->content_terms_len = 0;
+	context->dump_files = 0;
+	reset_options();
+}
+
+void reset_options() {
+	context->option_help = 0;
+	context->option_bfs = 0;
+	context->option_query = 0;
+	context->option_plain = 0;
+	context->option_monochrome = 0;
+	context->option_table = 0;
+	context->option_unhidden = 0;
+	context->option_verbose = 0;
+	context->option_stats = 0;
+	context->option_no_cache = 0;
+	context->option_decompress = 0;
+	context->option_parallel = 0;
+	context->option_unique = 0;
+	context->option_result_cache = 0;
+	context->option_watch = 0;
+	context->option_disk_order = 0;
+	context->option_serve = 0;
+	context->option_client = 0;
+	context->option_input = 0;
+	context->option_learn = 0;
+	context->option_pipeline = 0;
+	context->option_count = 0;
+	context->option_limit = 0;
+	context->option_file_type = 'a';
+	context->option_name_mode = '-';
+	context->option_name_pattern = 0;
+	context->option_name_case = 0;
+	context->option_name_omit = 0;
+	context->option_size = (range)RANGE_ANY;
+	context->option_age = (range)RANGE_ANY;
+	context->option_directory_age = (range)RANGE_ANY;
+	context->option_content_case = 0;
+	context->option_content_omit = 0;
+	context->option_content_only = 0;
+	context->option_content_multiline = 0;
+	context->option_content_around = 0;
+	context->option_content_all = 0;
+	context->option_content_exclude = 0;
+	context->option_content_limit = 0;
+}